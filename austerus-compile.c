@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "record.h"
+
+
+/*
+ * Print usage to terminal
+ */
+static void usage(void)
+{
+	printf("Usage: austerus-compile [OPTION]... INPUT OUTPUT\n"
+	"\n"
+	"Options:\n"
+	" -h, --help             Print this help message\n"
+	" -v, --verbose          Explain what is being done\n"
+	"\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint64_t count;
+	bool verbose = false;
+
+	int option_index = 0, opt=0;
+	static struct option loptions[] = {
+		{"help", no_argument, 0, 'h'},
+		{"verbose", no_argument, 0, 'v'}
+	};
+
+	while(opt >= 0) {
+		opt = getopt_long(argc, argv, "hv", loptions, &option_index);
+
+		switch (opt) {
+			case 'h':
+				usage();
+				return EXIT_SUCCESS;
+			case 'v':
+				verbose = true;
+				break;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	count = record_compile(argv[optind], argv[optind + 1], verbose);
+
+	if (verbose)
+		fprintf(stderr, "compiled %lu records\n",
+						(unsigned long)count);
+
+	return EXIT_SUCCESS;
+}
@@ -1,16 +1,28 @@
-#define _BSD_SOURCE /* usleep */
-#define _GNU_SOURCE /* getline */
+#define _GNU_SOURCE /* nice */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <signal.h>
 #include <termios.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
 #include "serial.h"
+#include "broker.h"
+#include "nbgetline.h"
 #include "protocol.h"
+#include "point.h"
+#include "gvm.h"
+#include "motion.h"
+#include "trace.h"
+#include "journal.h"
 #include "austerus-core.h"
 #include "defaults.h"
 
@@ -21,9 +33,38 @@ static char *serial_port = NULL;
 static char *filename = NULL;
 
 static int serial;
-static char *line_gcode = NULL;
 static FILE *output_file = NULL;
 
+/* Clients of a listening core and the one whose lines are being sent */
+static char *listen_path = NULL;
+static int listener = -1;
+static struct client clients[CLIENTS_MAX];
+static int owner = -1;
+
+/* Urgent lines and the state of the stream, set by priority commands */
+static struct linebuf urgent;
+static bool paused = false;
+static bool aborting = false;
+
+/* Exit once the lines before #ag:exit are written */
+static bool exiting = false;
+
+/* Time based flow control. Global to report on exit. */
+static long int buffer_time = 0;
+static struct planner planner;
+
+/* Line latency trace. Global to write on exit. */
+static struct trace trace = { -1 };
+
+/*
+ * Last acknowledged line of the source, and the line and offset in the source
+ * of the next line read. Lines are counted from the start of the input until
+ * set with #ag:src, and not counted after it sets line 0.
+ */
+static struct journal journal;
+static unsigned long int source_line = 1;
+static unsigned long int source_offset = 0;
+
 
 /*
  * Handle SIGTERM.
@@ -33,44 +74,682 @@ static void leave(int signal)
 	if (verbose > 0)
 		fprintf(stderr, "dispatcher exiting\n");
 
+	if (buffer_time > 0)
+		fprintf(stderr, "planner stalls: %lu, round trip: %.1fms\n",
+						planner.stalls, planner.rtt);
+
 	if (output_file)
 		fclose(output_file);
 
-	if (serial_port)
+	trace_close(&trace);
+	journal_close(&journal);
+
+	/* Lines written are not lost with the port */
+	if (serial_port) {
+		tcdrain(serial);
 		close(serial);
+	}
 
-	if (line_gcode)
-		free(line_gcode);
+	if (listener != -1) {
+		close(listener);
+		unlink(listen_path);
+	}
 
 	exit(signal);
 }
 
 
 /*
- * Process an internal austerusG control command.
+ * Act on "line" of "length" bytes, including its newline, if it is a priority
+ * command. Urgent lines are queued to be sent ahead of the stream, pause holds
+ * the stream while what has been sent is acknowledged, resume continues it
+ * and abort discards it. Returns false if "line" is not a priority command.
+ */
+static bool priority_command(const char *line, size_t length)
+{
+	if (strncmp(line, MSG_CMD_URGENT, MSG_CMD_URGENT_LEN) == 0) {
+		if (!linebuf_put(&urgent, line + MSG_CMD_URGENT_LEN,
+					length - MSG_CMD_URGENT_LEN))
+			fprintf(stderr, "Warning: urgent queue full\n");
+	} else if (strncmp(line, MSG_CMD_PAUSE, MSG_CMD_PAUSE_LEN) == 0) {
+		paused = true;
+	} else if (strncmp(line, MSG_CMD_RESUME, MSG_CMD_RESUME_LEN) == 0) {
+		paused = false;
+	} else if (strncmp(line, MSG_CMD_ABORT, MSG_CMD_ABORT_LEN) == 0) {
+		aborting = true;
+	} else {
+		return false;
+	}
+
+	if (verbose > 0)
+		fprintf(stderr, "priority command: %.*s", (int)length, line);
+
+	return true;
+}
+
+
+/*
+ * Act on the priority commands among the complete lines read into "lb" and
+ * remove them, so they take effect without waiting for the lines before them
+ * to be sent.
+ */
+static void priority_scan(struct linebuf *lb)
+{
+	char *line = lb->data + lb->start;
+	char *end = lb->data + lb->end;
+	char *found;
+	size_t length;
+
+	while ((found = memchr(line, '\n', end - line))) {
+		length = found + 1 - line;
+
+		if (strncmp(line, MSG_CMD, MSG_CMD_LEN) == 0 &&
+					priority_command(line, length)) {
+			memmove(line, found + 1, end - (found + 1));
+			end -= length;
+			lb->end -= length;
+		} else {
+			line = found + 1;
+		}
+	}
+}
+
+
+/*
+ * Close client "c", giving up its place as the sender.
+ */
+static void client_close(int c)
+{
+	if (verbose > 0)
+		fprintf(stderr, "client %d disconnected\n", c);
+
+	close(clients[c].fd);
+	clients[c].fd = -1;
+
+	if (owner == c)
+		owner = -1;
+}
+
+
+/*
+ * Accept a connection waiting on the listening socket.
+ */
+static void client_accept(void)
+{
+	int fd, c;
+
+	fd = broker_accept(listener);
+
+	if (fd == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("Warning: unable to accept client");
+
+		return;
+	}
+
+	for (c = 0; c < CLIENTS_MAX; c++)
+		if (clients[c].fd == -1)
+			break;
+
+	if (c == CLIENTS_MAX) {
+		fprintf(stderr, "Warning: too many clients\n");
+		close(fd);
+		return;
+	}
+
+	clients[c].fd = fd;
+	linebuf_init(&(clients[c].input));
+	linebuf_init(&(clients[c].output));
+
+	if (verbose > 0)
+		fprintf(stderr, "client %d connected\n", c);
+}
+
+
+/*
+ * Read from and write to the client on "fd" as "revents" from poll() allow,
+ * disconnecting it on error.
+ */
+static void client_service(int fd, short revents)
+{
+	int c;
+
+	for (c = 0; c < CLIENTS_MAX; c++)
+		if (clients[c].fd == fd)
+			break;
+
+	if (c == CLIENTS_MAX)
+		return;
+
+	if (revents & POLLOUT && linebuf_flush(&(clients[c].output), fd,
+				LINEBUF_LEN) == -1 && errno != EAGAIN) {
+		client_close(c);
+		return;
+	}
+
+	if (revents & (POLLIN | POLLERR | POLLHUP) && !clients[c].input.eof) {
+		if (linebuf_fill(&(clients[c].input), fd) == -1 &&
+				errno != EAGAIN && errno != ENOBUFS) {
+			client_close(c);
+			return;
+		}
+
+		priority_scan(&(clients[c].input));
+	}
+
+	/* A client that has hung up can no longer read its feedback */
+	if (revents & (POLLERR | POLLHUP) && clients[c].input.eof)
+		linebuf_init(&(clients[c].output));
+}
+
+
+/*
+ * Return the next client after "owner" with input waiting to be sent, or
+ * "owner" if there is none.
+ */
+static int client_next(void)
+{
+	int i, c;
+
+	for (i = 1; i <= CLIENTS_MAX; i++) {
+		c = (owner + i + CLIENTS_MAX) % CLIENTS_MAX;
+
+		if (clients[c].fd != -1 &&
+				linebuf_length(&(clients[c].input)) > 0)
+			return c;
+	}
+
+	return owner;
+}
+
+
+/*
+ * Pass "line" from the printer on. Without a listening socket it is written
+ * to stdout. Otherwise acknowledgements go to the client whose lines are
+ * being sent and everything else to every client. A client that is not
+ * reading its feedback is disconnected.
+ */
+static void feedback_put(const char *line, bool ack)
+{
+	size_t length = strlen(line);
+	int c;
+
+	if (listener == -1) {
+		printf("%s\n", line);
+		fflush(stdout);
+		return;
+	}
+
+	for (c = 0; c < CLIENTS_MAX; c++) {
+		if (clients[c].fd == -1 || (ack && c != owner))
+			continue;
+
+		if (linebuf_space(&(clients[c].output)) < length + 1) {
+			fprintf(stderr, "Warning: client %d not reading\n",
+									c);
+			client_close(c);
+			continue;
+		}
+
+		linebuf_put(&(clients[c].output), line, length);
+		linebuf_put(&(clients[c].output), "\n", 1);
+	}
+}
+
+
+/*
+ * Process an internal austerusG control command read from "source". Exit
+ * ends the input of a client of a listening core and the core otherwise, once
+ * the lines before it have been written.
+ */
+static void process_command(char *line, struct linebuf *source)
+{
+	char *end;
+
+	if (strncmp(line, MSG_CMD_EXIT, MSG_CMD_EXIT_LEN) == 0) {
+		if (listener == -1)
+			exiting = true;
+
+		source->eof = true;
+		source->start = source->end;
+	}
+
+	/* The line and offset in the source of the next line */
+	if (strncmp(line, MSG_CMD_SOURCE, MSG_CMD_SOURCE_LEN) == 0) {
+		source_line = strtoul(line + MSG_CMD_SOURCE_LEN, &end, 10);
+		source_offset = strtoul(end, NULL, 10);
+	}
+}
+
+
+/*
+ * Return the milliseconds of motion modelled as queued in the printer, both
+ * acknowledged and in the window.
+ */
+static double planner_queued(struct planner *p, struct window *w)
+{
+	double now = serial_clock();
+
+	return (p->finish > now ? p->finish - now : 0.0) + w->duration;
+}
+
+
+/*
+ * Return true if a line of "length" bytes must wait for acknowledgements. With
+ * a buffer time the modelled motion queued in the printer is limited to that
+ * time and the round trip for a line to reach it, with a receive buffer size
+ * the unacknowledged bytes are limited so they fit the printer's buffer, and
+ * without either the unacknowledged lines are limited to "ack_count" unless
+ * it is 0.
+ */
+static bool window_full(struct window *w, size_t length,
+				unsigned int ack_count, size_t rx_buffer)
+{
+	if (w->count >= WINDOW_LINES)
+		return true;
+
+	if (buffer_time > 0 &&
+			planner_queued(&planner, w) >= buffer_time + planner.rtt)
+		return true;
+
+	/* A line longer than the buffer is sent alone */
+	if (rx_buffer > 0)
+		return w->count > 0 && w->bytes + length > rx_buffer;
+
+	if (buffer_time > 0)
+		return false;
+
+	return ack_count > 0 && w->count >= ack_count;
+}
+
+
+/*
+ * Add a line of "length" bytes holding "duration" milliseconds of motion to
+ * the window. The acknowledgement of a "quiet" line is not passed on.
+ */
+static void window_push(struct window *w, size_t length, double duration,
+								bool quiet)
+{
+	unsigned int slot = (w->first + w->count) % WINDOW_LINES;
+
+	w->lengths[slot] = length;
+	w->durations[slot] = duration;
+	w->sent[slot] = serial_clock();
+	w->quiet[slot] = quiet;
+	w->sources[slot] = 0;
+	w->count++;
+	w->bytes += length;
+	w->duration += duration;
+}
+
+
+/*
+ * Note that the newest line in the window is "line" of the source, starting at
+ * "offset".
+ */
+static void window_source(struct window *w, unsigned long int line,
+						unsigned long int offset)
+{
+	unsigned int slot = (w->first + w->count - 1) % WINDOW_LINES;
+
+	w->sources[slot] = line;
+	w->offsets[slot] = offset;
+}
+
+
+/*
+ * Remove the oldest line from the window once it is acknowledged.
+ */
+static void window_pop(struct window *w)
+{
+	if (w->count == 0)
+		return;
+
+	w->bytes -= w->lengths[w->first];
+	w->duration -= w->durations[w->first];
+	w->first = (w->first + 1) % WINDOW_LINES;
+	w->count--;
+}
+
+
+/*
+ * Empty the window.
+ */
+static void window_clear(struct window *w)
+{
+	w->first = 0;
+	w->count = 0;
+	w->bytes = 0;
+	w->duration = 0.0;
+}
+
+
+/*
+ * Initialise "p" to an empty planner. The printer starts in absolute mode.
+ */
+static void planner_init(struct planner *p)
+{
+	gvm_init(&(p->m), false);
+	p->m.mode = MODE_ABSOLUTE;
+	motion_init(&(p->mo));
+
+	p->finish = 0.0;
+	p->moving = false;
+	p->rtt = 0.0;
+	p->stalls = 0;
+}
+
+
+/*
+ * Return the milliseconds of motion in gcode "line" of "length" bytes. Waits
+ * for heaters take no time as they hold back the acknowledgement instead.
+ */
+static double planner_line(struct planner *p, char *line, size_t length)
+{
+	double seconds;
+
+	p->m.map = line;
+	p->m.cursor = 0;
+	p->m.end = length;
+
+	gvm_step(&(p->m));
+	seconds = motion_step(&(p->mo), &(p->m));
+
+	if (p->m.waits)
+		return 0.0;
+
+	return seconds * 1000.0;
+}
+
+
+/*
+ * Move the oldest line of "w" into the planner "p" as it is acknowledged,
+ * measuring the round trip and counting a stall if the planner had run out
+ * of motion before the line arrived.
+ */
+static void planner_ack(struct planner *p, struct window *w)
+{
+	double now = serial_clock();
+	double duration;
+
+	if (w->count == 0)
+		return;
+
+	duration = w->durations[w->first];
+
+	if (p->rtt == 0.0)
+		p->rtt = now - w->sent[w->first];
+	else
+		p->rtt += ((now - w->sent[w->first]) - p->rtt) / 8.0;
+
+	if (duration <= 0.0) {
+		/* A wait empties the planner without a stall */
+		if (p->finish <= now)
+			p->moving = false;
+
+		return;
+	}
+
+	if (p->finish < now) {
+		if (p->moving) {
+			p->stalls++;
+
+			if (verbose > 0)
+				fprintf(stderr, "planner stall: %.1fms\n",
+							now - p->finish);
+		}
+
+		p->finish = now;
+	}
+
+	p->finish += duration;
+	p->moving = true;
+}
+
+
+/*
+ * Write "line" to "out" numbered "number" with its checksum as the printer
+ * expects when line numbers are checked. Comments and surrounding whitespace
+ * are dropped. Returns the length written or 0 if nothing is left to send.
+ */
+static size_t checksum_line(char *out, const char *line, long int number)
+{
+	const char *end;
+	size_t length, i;
+	unsigned char sum = 0;
+
+	end = strchr(line, ';');
+
+	if (end == NULL)
+		end = line + strlen(line);
+
+	while (end > line && isspace((unsigned char)end[-1]))
+		end--;
+
+	while (line < end && isspace((unsigned char)*line))
+		line++;
+
+	if (line == end)
+		return 0;
+
+	length = sprintf(out, "N%ld %.*s", number, (int)(end - line), line);
+
+	for (i = 0; i < length; i++)
+		sum ^= (unsigned char)out[i];
+
+	return length + sprintf(out + length, "*%u\n", (unsigned int)sum);
+}
+
+
+/*
+ * Keep numbered "line" of "length" bytes as the next line of "h". The
+ * acknowledgement of a "quiet" line is not passed on.
+ */
+static void history_add(struct history *h, const char *line, size_t length,
+								bool quiet)
+{
+	unsigned int slot;
+
+	h->last++;
+	slot = h->last % WINDOW_LINES;
+
+	if (h->sizes[slot] < length) {
+		h->lines[slot] = realloc(h->lines[slot], length);
+
+		if (h->lines[slot] == NULL) {
+			perror("Error: history");
+			leave(EXIT_FAILURE);
+		}
+
+		h->sizes[slot] = length;
+	}
+
+	memcpy(h->lines[slot], line, length);
+	h->lengths[slot] = length;
+	h->quiet[slot] = quiet;
+	h->sources[slot] = 0;
+}
+
+
+/*
+ * Note that the newest line of "h" is "line" of the source, starting at
+ * "offset".
+ */
+static void history_source(struct history *h, unsigned long int line,
+						unsigned long int offset)
+{
+	unsigned int slot = h->last % WINDOW_LINES;
+
+	h->sources[slot] = line;
+	h->offsets[slot] = offset;
+}
+
+
+/*
+ * Return line "number" of "h" and set "length" to its length, or NULL if it is
+ * no longer kept or was never sent.
+ */
+static char *history_get(struct history *h, long int number, size_t *length)
+{
+	if (number < 0 || number > h->last || number <= h->last - WINDOW_LINES)
+		return NULL;
+
+	*length = h->lengths[number % WINDOW_LINES];
+
+	return h->lines[number % WINDOW_LINES];
+}
+
+
+/*
+ * Return the line number the printer asks to be resent in "line" or -1 if it
+ * is not a resend request.
+ */
+static long int resend_request(const char *line)
+{
+	if (strncmp(line, MSG_RESEND, MSG_RESEND_LEN) == 0)
+		return strtol(line + MSG_RESEND_LEN, NULL, 10);
+
+	if (strncmp(line, MSG_RS, MSG_RS_LEN) == 0)
+		return strtol(line + MSG_RS_LEN, NULL, 10);
+
+	return -1;
+}
+
+
+/*
+ * Probe the printer until it acknowledges a command, passing on anything else
+ * it prints such as its start banner, then wait for the acknowledgements of
+ * the other probes written so none is taken for that of a line. Returns the
+ * milliseconds taken or -1 if the printer does not respond within "timeout"
+ * milliseconds. Probes lost while the printer started are waited for until
+ * then.
  */
-static void process_command(char *line)
+static long int handshake(struct linebuf *feedback, long int timeout)
 {
-	if (strncmp(line, MSG_CMD_EXIT, MSG_CMD_EXIT_LEN) == 0)
-		leave(EXIT_SUCCESS);
+	long int start = serial_clock();
+	long int probe = start;
+	long int now;
+	char *line;
+	unsigned long int probes = 0;
+	unsigned long int acks = 0;
+
+	/* Anything already received is from before the port was opened */
+	tcflush(serial, TCIFLUSH);
+
+	while (1) {
+		now = serial_clock();
+
+		if (now - start >= timeout) {
+			if (acks == 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			fprintf(stderr, "Warning: %lu of %lu probes not "
+					"acknowledged\n", probes - acks, probes);
+			return now - start;
+		}
+
+		if (acks == 0 && now >= probe) {
+			if (write(serial, PROBE, PROBE_LEN) == PROBE_LEN)
+				probes++;
+			else if (errno != EAGAIN)
+				return -1;
+
+			probe = now + PROBE_INTERVAL;
+		}
+
+		if (serial_getline(serial, feedback, &line, acks ?
+				start + timeout - now : probe - now) == -1) {
+			if (errno != ETIMEDOUT)
+				return -1;
+
+			continue;
+		}
+
+		if (strncmp(line, MSG_ACK, MSG_ACK_LEN) != 0) {
+			feedback_put(line, false);
+			continue;
+		}
+
+		if (++acks >= probes)
+			return serial_clock() - start;
+	}
 }
 
 
 int main(int argc, char* argv[])
 {
-	/* Number of outstanding acknowledgements */
-	unsigned int ack_outstanding = 0;
+	/* Outstanding acknowledgements */
+	struct window window;
 
 	ssize_t bytes_r, bytes_w;
-	size_t line_gcode_len = 0;
 
-	/* Buffer for reading from serial port */
-	char line_feedback[SERIAL_LINE_LEN];
+	/* Line read from stdin waiting for a place in the window */
+	char line_gcode[LINEBUF_LEN];
+	ssize_t pending = 0;
+	int64_t pending_read = 0;
+
+	/* Urgent line waiting to be written */
+	char line_urgent[LINEBUF_LEN];
+	ssize_t urgent_pending = 0;
+	int64_t urgent_read = 0;
+
+	/* Line to write to the serial port */
+	char line_checksum[LINEBUF_LEN + 32];
+	char *line_out;
+	size_t line_out_len;
+
+	/* Numbered lines for resending */
+	struct history history;
+	long int resend = 0;
+	long int resend_number = -1;
+	long int resend_repeats = 0;
+	bool resending;
+	unsigned int slot;
+	long int number;
+
+	/* Acknowledgements of lines the printer rejected */
+	unsigned int rejected = 0;
+	bool quiet;
+
+	/* Line read from serial port */
+	char *line_feedback;
+	size_t line_feedback_len;
+
+	/* Bytes read from stdin and serial and waiting to be written */
+	struct linebuf input;
+	struct linebuf feedback;
+	struct linebuf output;
+
+	/* Where lines are read from, stdin or the sending client */
+	struct linebuf *source;
+	bool idle;
+	int c;
+
+	/* Position in the source of the line waiting */
+	unsigned long int pending_line = 0;
+	unsigned long int pending_offset = 0;
+
+	/* Bytes in the kernel transmit queue */
+	int queued = 0;
+
+	struct pollfd fds[3 + CLIENTS_MAX];
+	nfds_t nfds, i;
+	long int deadline;
+	long int timeout;
+	long int drain;
 
 	/* User options */
 	int baudrate		= DEFAULT_BAUDRATE;
-	int serial_timeout	= DEFAULT_TIMEOUT;
+	long int serial_timeout	= DEFAULT_TIMEOUT * 1000L;
 	unsigned int ack_count	= DEFAULT_ACKCOUNT;
+	size_t rx_buffer	= 0;
+	int tx_queue		= 0;
+	bool checksum		= false;
+	bool low_latency	= false;
+	bool no_reset		= false;
+	long int ready;
 
 #ifdef SETUID
 	uid_t ruid = getuid();
@@ -105,6 +784,11 @@ int main(int argc, char* argv[])
 	/* Read environmental variables */
 	filename	= getenv("AG_DUMP");
 	serial_port	= getenv("AG_SERIALPORT");
+	listen_path	= getenv("AG_LISTEN");
+
+	/* Relay for a core that already has the serial port open */
+	if (getenv("AG_CONNECT"))
+		return broker_relay(getenv("AG_CONNECT"));
 
 	/* Allow special NULL string to disable serial port for testing. */
 	if (serial_port) {
@@ -118,12 +802,39 @@ int main(int argc, char* argv[])
 	if (getenv("AG_ACKCOUNT"))
 		ack_count = strtol(getenv("AG_ACKCOUNT"), NULL, 10);
 
+	if (getenv("AG_RXBUFFER"))
+		rx_buffer = strtoul(getenv("AG_RXBUFFER"), NULL, 10);
+
+	if (getenv("AG_TXQUEUE"))
+		tx_queue = strtol(getenv("AG_TXQUEUE"), NULL, 10);
+
+	if (getenv("AG_BUFFERTIME"))
+		buffer_time = strtol(getenv("AG_BUFFERTIME"), NULL, 10);
+
+	if (getenv("AG_LOWLATENCY"))
+		low_latency = strtol(getenv("AG_LOWLATENCY"), NULL, 10) != 0;
+
+	if (getenv("AG_NORESET"))
+		no_reset = strtol(getenv("AG_NORESET"), NULL, 10) != 0;
+
+	if (getenv("AG_CHECKSUM"))
+		checksum = strtol(getenv("AG_CHECKSUM"), NULL, 10) != 0;
+
 	if (getenv("AG_VERBOSE"))
 		verbose = strtol(getenv("AG_VERBOSE"), NULL, 10);
 
+	if (getenv("AG_TRACE") && !trace_open(&trace, getenv("AG_TRACE")))
+		perror("Warning: unable to open trace");
+
+	if (getenv("AG_JOURNAL") &&
+				!journal_open(&journal, getenv("AG_JOURNAL")))
+		perror("Warning: unable to open journal");
+
 	if (verbose > 0)
 		fprintf(stderr, "verbose mode\n");
 
+	linebuf_init(&feedback);
+
 	/* Initalise serial port if required */
 	if (serial_port) {
 		if (verbose > 0)
@@ -137,23 +848,20 @@ int main(int argc, char* argv[])
 			return EXIT_FAILURE;
 		}
 
-		usleep(SERIAL_INIT_PAUSE);
-		tcflush(serial, TCIOFLUSH);
-		usleep(SERIAL_INIT_PAUSE);
+		if (low_latency && serial_low_latency(serial) == -1)
+			perror("Warning: unable to set low latency");
+
+		if (no_reset && serial_no_hangup(serial) == -1)
+			perror("Warning: unable to keep DTR raised");
 
-		/* Read initialisation message */
-		bytes_r = serial_getline(serial, line_feedback, serial_timeout);
+		ready = handshake(&feedback, serial_timeout);
 
-		if (bytes_r == -1) {
-			perror("Error: serial port timeout");
+		if (ready == -1) {
+			perror("Error: printer not responding");
 			return EXIT_FAILURE;
 		}
 
-		printf("%s\n", line_feedback);
-
-		usleep(SERIAL_INIT_PAUSE);
-		tcflush(serial, TCIOFLUSH);
-		usleep(SERIAL_INIT_PAUSE);
+		fprintf(stderr, "ready in %ldms\n", ready);
 	}
 
 	/* Open output file if required */
@@ -169,88 +877,544 @@ int main(int argc, char* argv[])
 			fprintf(stderr, "output to %s\n", filename);
 	}
 
+	/* Listen for clients instead of reading stdin */
+	if (listen_path) {
+		listener = broker_listen(listen_path);
+
+		if (listener == -1) {
+			perror("Error: unable to listen for clients");
+			leave(EXIT_FAILURE);
+		}
+
+		for (c = 0; c < CLIENTS_MAX; c++)
+			clients[c].fd = -1;
+
+		/* Clients that have gone are noticed when writing to them */
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGTERM, leave);
+
+		if (verbose > 0)
+			fprintf(stderr, "listening on %s\n", listen_path);
+	}
+
 	if (verbose > 0)
 		fprintf(stderr, "ready\n");
 
+	/*
+	 * Standard input is only read once poll() finds it readable, so it is
+	 * left blocking for whatever shares it after the program exits.
+	 */
+
+	linebuf_init(&input);
+	linebuf_init(&output);
+	linebuf_init(&urgent);
+	window_clear(&window);
+	planner_init(&planner);
+
+	memset(&history, 0, sizeof(struct history));
+	history.last = -1;
+
+	/* Start numbering lines from 0, its acknowledgement is not passed on */
+	if (serial_port && checksum) {
+		line_out_len = checksum_line(line_checksum, "M110 N0", 0);
+		linebuf_put(&output, line_checksum, line_out_len);
+		history_add(&history, line_checksum, line_out_len, false);
+		window_push(&window, line_out_len, 0.0, false);
+		trace_queued(&trace, line_out_len, 0, 0);
+		resend = 1;
+		rejected++;
+	}
+
+	deadline = serial_clock() + serial_timeout;
+
 	/* Start of main communications loop */
 	while (1) {
+		idle = pending == 0 && linebuf_length(&output) == 0 &&
+				window.count == 0 && resend > history.last;
 
 		/*
-		 * Keep sending lines until we reach the maximum outstanding
-		 * acknoledgements.
+		 * A client sends until it has no lines waiting and all it sent
+		 * is acknowledged, then the next client with lines takes over.
 		 */
-		while (ack_outstanding < ack_count || ack_count == 0) {
+		source = &input;
+
+		if (listener != -1) {
+			if (idle && (owner == -1 ||
+				linebuf_length(&(clients[owner].input)) == 0)) {
+				c = client_next();
+
+				/* Count the lines of a new client's input */
+				if (c != owner) {
+					source_line = 1;
+					source_offset = 0;
+				}
+
+				owner = c;
+			}
+
+			source = owner == -1 ? NULL : &(clients[owner].input);
+		}
+
+		/* Discard the rest of the stream being sent */
+		if (aborting) {
+			aborting = false;
+			paused = false;
+			pending = 0;
+
+			if (source) {
+				source->eof = true;
+				source->start = source->end;
+			}
+
+			if (verbose > 0)
+				fprintf(stderr, "stream aborted\n");
+		}
 
-			/* Block until we have a complete line from stdin */
-			bytes_r = getline(&line_gcode, &line_gcode_len, stdin);
+		/*
+		 * Urgent lines are written ahead of the stream without waiting
+		 * for a place in the window.
+		 */
+		while (1) {
+			if (urgent_pending == 0) {
+				urgent_pending = linebuf_getline(&urgent,
+					line_urgent, sizeof(line_urgent));
+				urgent_read = trace.fd == -1 ? 0 :
+								trace_clock();
+			}
 
-			/* Check if stream is closed */
-			if (bytes_r == -1)
-				leave(EXIT_SUCCESS);
+			if (urgent_pending == 0)
+				break;
 
-			/* Handle internal austerusG control commands */
-			if (strncmp(line_gcode, MSG_CMD, MSG_CMD_LEN) == 0) {
-				process_command(line_gcode);
+			/* The missing printer has nothing to stop */
+			if (!serial_port || urgent_pending <= 1) {
+				urgent_pending = 0;
 				continue;
 			}
 
-			if (output_file) {
-				fprintf(output_file, "%s", line_gcode);
-				fflush(output_file);
+			/*
+			 * A printer that asked for lines again rejects any
+			 * other, so wait until they have been resent.
+			 */
+			if (checksum && resend <= history.last)
+				break;
+
+			if (checksum) {
+				line_out = line_checksum;
+				line_out_len = checksum_line(line_checksum,
+						line_urgent, history.last + 1);
+
+				if (line_out_len == 0) {
+					urgent_pending = 0;
+					continue;
+				}
+			} else {
+				line_out = line_urgent;
+				line_out_len = urgent_pending;
+			}
+
+			if (window.count >= WINDOW_LINES ||
+				!linebuf_put(&output, line_out, line_out_len))
+				break;
+
+			if (window.count == 0)
+				deadline = serial_clock() + serial_timeout;
+
+			window_push(&window, line_out_len, 0.0, true);
+			trace_queued(&trace, line_out_len, urgent_read,
+								TRACE_QUIET);
+
+			if (checksum) {
+				history_add(&history, line_out, line_out_len,
+									true);
+				resend = history.last + 1;
 			}
 
-			if (serial_port) {
+			urgent_pending = 0;
+		}
+
+		/*
+		 * Queue lines for the printer until the window of outstanding
+		 * acknowledgements is full.
+		 */
+		while (1) {
+			/* Resend lines the printer asked for before new ones */
+			line_out = history_get(&history, resend,
+							&line_out_len);
+			resending = line_out != NULL;
+
+			/* Lines already sent are resent while paused */
+			if (!resending && paused)
+				break;
+
+			if (!resending && pending == 0) {
+				if (source == NULL)
+					break;
+
+				pending = linebuf_getline(source, line_gcode,
+							sizeof(line_gcode));
+				if (pending == 0)
+					break;
+
+				pending_read = trace.fd == -1 ? 0 :
+								trace_clock();
+
+				/* Commands are not lines of the source */
+				if (strncmp(line_gcode, MSG_CMD,
+							MSG_CMD_LEN) == 0) {
+					process_command(line_gcode, source);
+					pending = 0;
+					continue;
+				}
+
+				pending_line = source_line;
+				pending_offset = source_offset;
+
+				if (source_line > 0) {
+					source_line++;
+					source_offset += pending;
+				}
+
+				if (output_file) {
+					fprintf(output_file, "%s", line_gcode);
+					fflush(output_file);
+				}
+
 				/* Don't send empty lines */
-				if (bytes_r <= 1)
+				if (pending <= 1) {
+					pending = 0;
 					continue;
+				}
+			}
 
-				/* Write the line to the serial port */
-				bytes_w = write(serial, line_gcode, bytes_r);
-				if (bytes_w != bytes_r) {
-					perror("Error: write error");
-					leave(EXIT_FAILURE);
+			if (!serial_port) {
+				/* Acknowledge for the missing printer */
+				feedback_put(MSG_ACK, true);
+				pending = 0;
+				continue;
+			}
+
+			if (resending) {
+				/* Already numbered */
+			} else if (checksum) {
+				line_out = line_checksum;
+				line_out_len = checksum_line(line_checksum,
+						line_gcode, history.last + 1);
+
+				if (line_out_len == 0) {
+					pending = 0;
+					continue;
 				}
+			} else {
+				line_out = line_gcode;
+				line_out_len = pending;
+			}
+
+			if (window_full(&window, line_out_len, ack_count,
+								rx_buffer))
+				break;
+
+			/* Wait for the line to fit behind those being sent */
+			if (!linebuf_put(&output, line_out, line_out_len))
+				break;
+
+			if (window.count == 0)
+				deadline = serial_clock() + serial_timeout;
+
+			if (resending) {
+				slot = resend % WINDOW_LINES;
+
+				window_push(&window, line_out_len, 0.0,
+							history.quiet[slot]);
+				window_source(&window, history.sources[slot],
+							history.offsets[slot]);
+				trace_queued(&trace, line_out_len, 0,
+					history.quiet[slot] ? TRACE_QUIET : 0);
+				resend++;
+				continue;
+			}
+
+			window_push(&window, line_out_len, buffer_time > 0 ?
+				planner_line(&planner, line_gcode, pending) :
+								0.0, false);
+			trace_queued(&trace, line_out_len, pending_read, 0);
+			window_source(&window, pending_line, pending_offset);
+
+			if (checksum) {
+				history_add(&history, line_out, line_out_len,
+									false);
+				history_source(&history, pending_line,
+							pending_offset);
+				resend = history.last + 1;
 			}
 
-			ack_outstanding++;
+			pending = 0;
+		}
+
+		idle = pending == 0 && linebuf_length(&output) == 0 &&
+				window.count == 0 && resend > history.last;
+
+		/*
+		 * Leave once everything read has been sent and acknowledged,
+		 * or on exit once it has been written without waiting for a
+		 * printer that may have been stopped.
+		 */
+		if (listener == -1 && input.eof &&
+					linebuf_length(&input) == 0 && idle)
+			leave(EXIT_SUCCESS);
+
+		if (exiting && pending == 0 && urgent_pending == 0 &&
+				linebuf_length(&urgent) == 0 &&
+				linebuf_length(&output) == 0)
+			leave(EXIT_SUCCESS);
+
+		nfds = 0;
+
+		/* Read ahead from stdin while there is space to queue it */
+		if (listener == -1 && !input.eof &&
+						linebuf_space(&input) > 0) {
+			fds[nfds].fd = STDIN_FILENO;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		if (listener != -1) {
+			fds[nfds].fd = listener;
+			fds[nfds].events = POLLIN;
+			nfds++;
 		}
 
 		/*
-		 * We must wait for at least one acknowledgement before we
-		 * can send any more lines.
+		 * Disconnect clients once their input has ended and their
+		 * lines are acknowledged and feedback written.
 		 */
+		for (c = 0; listener != -1 && c < CLIENTS_MAX; c++) {
+			if (clients[c].fd == -1)
+				continue;
+
+			if (clients[c].input.eof &&
+				linebuf_length(&(clients[c].input)) == 0 &&
+				(c != owner || idle) &&
+				linebuf_length(&(clients[c].output)) == 0) {
+				client_close(c);
+				continue;
+			}
+
+			fds[nfds].fd = clients[c].fd;
+			fds[nfds].events = 0;
+
+			if (!clients[c].input.eof &&
+				linebuf_space(&(clients[c].input)) > 0)
+				fds[nfds].events |= POLLIN;
+
+			if (linebuf_length(&(clients[c].output)) > 0)
+				fds[nfds].events |= POLLOUT;
+
+			/* Waiting its turn, a hang up is found on writing */
+			if (fds[nfds].events)
+				nfds++;
+		}
+
+		drain = -1;
+
+		if (serial_port) {
+			fds[nfds].fd = serial;
+			fds[nfds].events = POLLIN;
 
-		while (ack_outstanding >= ack_count && ack_count > 0) {
 			/*
-			 * Block until we have read an entire line from
-			 * serial or we timeout.
+			 * Hold bytes back while the kernel transmit queue is
+			 * at its limit and wake when enough should have left
+			 * at 10 bits per byte.
 			 */
-			bytes_r = serial_getline(serial, line_feedback, serial_timeout);
+			if (linebuf_length(&output) > 0) {
+				if (tx_queue > 0 && ioctl(serial, TIOCOUTQ,
+							&queued) == 0 &&
+							queued >= tx_queue)
+					drain = 1 + (queued - tx_queue + 1) *
+							10000L / baudrate;
+				else
+					fds[nfds].events |= POLLOUT;
+			}
 
-			if (bytes_r == -1) {
-				perror("Error: serial timeout, clearing serial buffer");
-				tcflush(serial, TCIOFLUSH);
-				ack_outstanding = 0;
+			nfds++;
+		}
 
-			} else if (strncmp(line_feedback, MSG_ACK, MSG_ACK_LEN) == 0 ||
-					strncmp(line_feedback, MSG_DUD, MSG_DUD_LEN) == 0) {
-				/*
-				 * If the line is an ACK (either ok or error)
-				 * then decrement count and send to stdout.
-				 */
+		/* Only time out while waiting for acknowledgements */
+		timeout = -1;
 
-				ack_outstanding--;
-				printf("%s\n", line_feedback);
-				fflush(stdout);
+		if (serial_port && window.count > 0) {
+			timeout = deadline - serial_clock();
 
-			} else {
+			if (timeout < 0)
+				timeout = 0;
+		}
+
+		if (drain >= 0 && (timeout < 0 || drain < timeout))
+			timeout = drain;
+
+		/* Wake when the planner has room for more motion */
+		if (serial_port && buffer_time > 0) {
+			drain = planner_queued(&planner, &window) -
+					(buffer_time + planner.rtt) + 1;
+
+			if (drain > 0 && (timeout < 0 || drain < timeout))
+				timeout = drain;
+		}
+
+		/* Write the trace and journal while waiting for the printer */
+		trace_flush(&trace, false);
+		journal_sync(&journal, serial_clock());
+
+		if (poll(fds, nfds, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("Error: poll");
+			leave(EXIT_FAILURE);
+		}
+
+		if (serial_port && window.count > 0 &&
+						serial_clock() >= deadline) {
+			window_clear(&window);
+			trace_clear(&trace);
+
+			if (checksum && history.last >= 0) {
 				/*
-				 * If the line is not an ACK then just send
-				 * to stdout.
+				 * Resend the last line so the printer asks
+				 * for any it lost.
 				 */
-				printf("%s\n", line_feedback);
-				fflush(stdout);
+				fprintf(stderr, "Error: serial timeout, "
+						"resending line %ld\n",
+						history.last);
+				resend = history.last;
+				resend_repeats = 0;
+				rejected = 0;
+			} else {
+				perror("Error: serial timeout, clearing "
+							"serial buffer");
+				tcflush(serial, TCIOFLUSH);
+			}
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			if (fds[i].fd == listener) {
+				client_accept();
+				continue;
+			}
+
+			if (listener == -1 && fds[i].fd == STDIN_FILENO) {
+				bytes_r = linebuf_fill(&input, STDIN_FILENO);
+
+				if (bytes_r == -1 && errno != EAGAIN) {
+					perror("Error: read error");
+					leave(EXIT_FAILURE);
+				}
+
+				priority_scan(&input);
+				continue;
+			}
+
+			if (!serial_port || fds[i].fd != serial) {
+				client_service(fds[i].fd, fds[i].revents);
+				continue;
+			}
+
+			if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+				bytes_r = linebuf_fill(&feedback, serial);
+
+				if (bytes_r == 0 || (bytes_r == -1 &&
+							errno != EAGAIN)) {
+					perror("Error: serial read error");
+					leave(EXIT_FAILURE);
+				}
 			}
+
+			if (fds[i].revents & POLLOUT) {
+				bytes_w = linebuf_flush(&output, serial,
+					tx_queue > 0 ? (size_t)(tx_queue -
+						queued) : LINEBUF_LEN);
+
+				if (bytes_w == -1 && errno != EAGAIN) {
+					perror("Error: write error");
+					leave(EXIT_FAILURE);
+				}
+
+				if (bytes_w > 0)
+					trace_written(&trace, bytes_w);
+			}
+		}
+
+		while ((line_feedback = linebuf_next(&feedback,
+						&line_feedback_len))) {
+			/*
+			 * A rejected line is followed by a resend request for
+			 * the first line the printer is missing and then an
+			 * acknowledgement, for every line sent after it as
+			 * well. Only the first request is acted on.
+			 */
+			number = resend_request(line_feedback);
+
+			if (checksum && number >= 0 && strncmp(line_feedback,
+					MSG_DUD, MSG_DUD_LEN) != 0) {
+				rejected++;
+
+				if (number == resend_number &&
+							resend_repeats > 0) {
+					resend_repeats--;
+				} else if (number == history.last + 1 ||
+						history_get(&history, number,
+							&line_out_len)) {
+					resend_number = number;
+					resend_repeats = history.last - number;
+					resend = number;
+				} else {
+					fprintf(stderr, "Error: unable to "
+						"resend line %ld\n", number);
+					leave(EXIT_FAILURE);
+				}
+
+				feedback_put(line_feedback, false);
+				continue;
+			}
+
+			/*
+			 * Acknowledgements (either ok or error) free a place
+			 * in the window. All lines are sent to stdout except
+			 * acknowledgements of rejected lines.
+			 */
+			if (strncmp(line_feedback, MSG_ACK, MSG_ACK_LEN) == 0 ||
+					strncmp(line_feedback, MSG_DUD,
+						MSG_DUD_LEN) == 0) {
+				quiet = window.count > 0 &&
+						window.quiet[window.first];
+
+				/* A rejected line is journaled once resent */
+				if (window.count > 0 && rejected == 0 &&
+						window.sources[window.first])
+					journal_ack(&journal,
+						window.sources[window.first],
+						window.offsets[window.first]);
+
+				planner_ack(&planner, &window);
+				window_pop(&window);
+				trace_acked(&trace);
+				deadline = serial_clock() + serial_timeout;
+
+				if (rejected > 0) {
+					rejected--;
+					continue;
+				}
+
+				/* Urgent lines are acknowledged to no one */
+				if (!quiet)
+					feedback_put(line_feedback, true);
+
+				continue;
+			}
+
+			feedback_put(line_feedback, false);
 		}
 	}
 }
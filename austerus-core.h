@@ -1,2 +1,73 @@
-#define SERIAL_LINE_LEN		2048
-#define SERIAL_INIT_PAUSE	500000
+/* Command sent until the printer acknowledges it once it has started */
+#define PROBE			"M105\n"
+#define PROBE_LEN		5
+/* Milliseconds between probes */
+#define PROBE_INTERVAL		250
+#define WINDOW_LINES		256
+/* Clients connected at once to a listening core */
+#define CLIENTS_MAX		8
+
+
+/*
+ * Lines written to the printer and not yet acknowledged, oldest first, with
+ * their lengths for counting the bytes held in the printer's receive buffer,
+ * the milliseconds of motion they hold, when they were written, whether
+ * their acknowledgements are passed on and the line and offset in the source
+ * they came from, line 0 if none.
+ */
+struct window {
+	size_t lengths[WINDOW_LINES];
+	double durations[WINDOW_LINES];
+	long int sent[WINDOW_LINES];
+	bool quiet[WINDOW_LINES];
+	unsigned long int sources[WINDOW_LINES];
+	unsigned long int offsets[WINDOW_LINES];
+	unsigned int first;
+	unsigned int count;
+	size_t bytes;
+	double duration;
+};
+
+
+/*
+ * Model of the motion queued in the printer's planner for time based flow
+ * control. Lines enter the planner when acknowledged and their motion is
+ * done at "finish", a time in milliseconds.
+ */
+struct planner {
+	struct gvm m;
+	struct motion mo;
+	double finish;
+	bool moving;
+	double rtt;
+	unsigned long int stalls;
+};
+
+
+/*
+ * Numbered lines recently written to the printer, kept to answer requests to
+ * resend them. Line "n" is in slot n % WINDOW_LINES while it is one of the
+ * last WINDOW_LINES lines. "quiet", "sources" and "offsets" are as in the
+ * window, so a resent line is still journaled and its acknowledgement is
+ * still passed on or not.
+ */
+struct history {
+	char *lines[WINDOW_LINES];
+	size_t lengths[WINDOW_LINES];
+	size_t sizes[WINDOW_LINES];
+	bool quiet[WINDOW_LINES];
+	unsigned long int sources[WINDOW_LINES];
+	unsigned long int offsets[WINDOW_LINES];
+	long int last;
+};
+
+
+/*
+ * A client of a core listening on a socket, with the bytes it has sent and
+ * those waiting to be written to it. Unused clients have "fd" -1.
+ */
+struct client {
+	int fd;
+	struct linebuf input;
+	struct linebuf output;
+};
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "layers.h"
+
+
+/*
+ * Print usage to terminal
+ */
+static void usage(void)
+{
+	printf("Usage: austerus-layers [OPTION]... [FILE]\n"
+	"\n"
+	"Options:\n"
+	" -h, --help             Print this help message\n"
+	" -l, --line=line        Print only the layer containing line\n"
+	" -w, --write            Write the index next to the gcode file\n"
+	" -f, --force            Index the file even if an index exists\n"
+	"\n");
+}
+
+
+/*
+ * Print one layer as a row of tab separated values.
+ */
+static void print_layer(const struct layer *layers, const struct layer *l)
+{
+	printf("%u\t%u\t%lu\t%f\t%f\t%f\t%f", (unsigned int)(l - layers),
+			l->line, (unsigned long)l->offset,
+			(float)l->z / 1000.0, (float)l->filament / 1000.0,
+			(float)l->elapsed / 1000.0,
+			(float)l->duration / 1000.0);
+
+	if (l->bounds[0][0] > l->bounds[0][1]) {
+		printf("\t-\t-\t-\t-\n");
+		return;
+	}
+
+	printf("\t%f\t%f\t%f\t%f\n",
+		(float)l->bounds[0][0] / 1000.0,
+		(float)l->bounds[0][1] / 1000.0,
+		(float)l->bounds[1][0] / 1000.0,
+		(float)l->bounds[1][1] / 1000.0);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct layer *layers = NULL;
+	const struct layer *l;
+	size_t count = 0;
+	size_t i;
+
+	unsigned int line = 0;
+	bool write = false;
+	bool force = false;
+	char *path;
+
+	int option_index = 0, opt=0;
+	static struct option loptions[] = {
+		{"help", no_argument, 0, 'h'},
+		{"line", required_argument, 0, 'l'},
+		{"write", no_argument, 0, 'w'},
+		{"force", no_argument, 0, 'f'}
+	};
+
+	while(opt >= 0) {
+		opt = getopt_long(argc, argv, "hl:wf", loptions,
+							&option_index);
+
+		switch (opt) {
+			case 'h':
+				usage();
+				return EXIT_SUCCESS;
+			case 'l':
+				line = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				write = true;
+				break;
+			case 'f':
+				force = true;
+				break;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	path = layers_path(argv[optind]);
+
+	if (!force)
+		layers = layers_read(path, argv[optind], &count);
+
+	if (layers == NULL) {
+		count = layers_index(&layers, argv[optind]);
+
+		if (write)
+			layers_write(path, argv[optind], layers, count);
+	}
+
+	if (line > 0) {
+		l = layers_find(layers, count, line);
+
+		if (l == NULL) {
+			fprintf(stderr, "line %u is in no layer\n", line);
+			return EXIT_FAILURE;
+		}
+
+		print_layer(layers, l);
+	} else {
+		for (i = 0; i < count; i++)
+			print_layer(layers, &(layers[i]));
+	}
+
+	free(layers);
+	free(path);
+
+	return EXIT_SUCCESS;
+}
@@ -1,12 +1,15 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ncurses.h>
 #include <form.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <sys/wait.h>
 
 
@@ -14,6 +17,7 @@
 #include "machine.h"
 #include "popen2.h"
 #include "nbgetline.h"
+#include "protocol.h"
 
 
 /*
@@ -264,7 +268,6 @@ void usage(void)
 
 
 int main(int argc, char* argv[]) {
-	int nbytes;
 	int status;
 
 	unsigned int previous = 0;
@@ -295,20 +298,24 @@ int main(int argc, char* argv[]) {
 	int posX=0, posY=0, posZ=0;
 	float posE=0.0;
 	int extruding=0;
+	int paused=0;
 
 	int pipe_gcode = 0, pipe_feedback = 0;
 	/*stream_gcode = fdopen(pipe_gcode[1], "w"); */
 
-	FILE *stream_gcode = NULL, *stream_feedback = NULL;
+	FILE *stream_gcode = NULL;
 
 	/* User options */
 	char *serial_port = NULL;
 
 	char *cmd = NULL;	/* Command string to execute austerus-core */
 
-	/*size_t line_feedback_len = PIPE_LINE_BUFFER_LEN; */
-	/*char *line_feedback = NULL; */
-	char line_feedback[LINE_FEEDBACK_LEN];
+	/* Feedback from the core, read as it arrives */
+	struct linebuf feedback;
+	char *line_feedback;
+	size_t line_feedback_len;
+	struct pollfd fds[2];
+	nfds_t nfds;
 
 	/* Allocate inital size of input line buffer */
 	/*pipe_buffer = (char *) malloc (pipe_buffer_len + 1); */
@@ -354,7 +361,8 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
-	if (!serial_port & !getenv("AG_SERIALPORT")) {
+	/* A core listening on AG_CONNECT already has the port open */
+	if (!serial_port & !getenv("AG_SERIALPORT") && !getenv("AG_CONNECT")) {
 		fprintf(stderr, "A serial port must be specified\n");
 		return EXIT_FAILURE;
 	}
@@ -369,17 +377,13 @@ int main(int argc, char* argv[]) {
 	fcntl(pipe_feedback, F_SETFL, O_NONBLOCK);
 
 	stream_gcode = fdopen(pipe_gcode, "w");
-	stream_feedback = fdopen(pipe_feedback, "r");
 
 	if (!stream_gcode) {
 		fprintf(stderr, "unable to open output stream\n");
 		return EXIT_FAILURE;
 	}
 
-	if (!stream_feedback) {
-		fprintf(stderr, "unable to open feedback stream\n");
-		return EXIT_FAILURE;
-	}
+	linebuf_init(&feedback);
 
 	/* Start curses mode */
 	initscr();
@@ -392,8 +396,8 @@ int main(int argc, char* argv[]) {
 	/* Hide cursor */
 	curs_set(0);
 
-	/* Timeout so we can run extruder and check for feedback */
-	timeout(CURSES_TIMEOUT);
+	/* Keys are waited for with feedback in poll() */
+	timeout(0);
 
 	/* draw initial screen */
 	mvprintw(0, 0, "austerusG %s", VERSION);
@@ -424,7 +428,46 @@ int main(int argc, char* argv[]) {
 	fflush(stream_gcode);
 
 	while (1) {
-		/* Wait for user input */
+		/* Wait for user input or feedback, with a timeout so we can run
+		 * the extruder */
+		nfds = 0;
+
+		fds[nfds].fd = STDIN_FILENO;
+		fds[nfds].events = POLLIN;
+		nfds++;
+
+		if (!feedback.eof) {
+			fds[nfds].fd = pipe_feedback;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		if (poll(fds, nfds, CURSES_TIMEOUT) == -1 && errno != EINTR) {
+			endwin();
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+
+		/* Show each line of feedback as it arrives */
+		if (nfds > 1 && fds[1].revents &&
+				linebuf_fill(&feedback, pipe_feedback) == -1 &&
+				errno != EAGAIN)
+			feedback.eof = true;
+
+		while ((line_feedback = linebuf_next(&feedback,
+						&line_feedback_len))) {
+			sscanf(line_feedback, "ok T:%u B:%u",
+					&temp_extruder, &temp_bed);
+
+			if (line_feedback_len > 66)
+				strcpy(line_feedback + 63, "...");
+
+			move(LINES - 2, 0);
+			clrtoeol();
+			mvprintw(LINES - 2, 0, "Response: %s", line_feedback);
+			print_temperature(temp_extruder, temp_target);
+		}
+
 		ch = getch();
 
 		/* Handle any two key sequences */
@@ -636,27 +679,50 @@ int main(int argc, char* argv[]) {
 
 				break;
 
+			case 'p':
+			case 'P':
+				/* Hold or continue the lines being sent */
+				paused = !paused;
+
+				if (paused) {
+					fprintf(stream_gcode, "%s\n",
+								MSG_CMD_PAUSE);
+					mvprintw(LINES - 1, 0, "Status: Paused  ");
+				} else {
+					fprintf(stream_gcode, "%s\n",
+								MSG_CMD_RESUME);
+					mvprintw(LINES - 1, 0, "Status: Resumed ");
+				}
+
+				fflush(stream_gcode);
+				break;
+
+			case 'k':
+			case 'K':
+				/* Abandon the lines being sent */
+				fprintf(stream_gcode, "%s\n", MSG_CMD_ABORT);
+				fflush(stream_gcode);
+				paused = 0;
+				mvprintw(LINES - 1, 0, "Status: Aborted ");
+
+				break;
+
 			case 'q':
 			case KEY_ESC:
-				/* Shutdown printer */
-				fprintf(stream_gcode, "M112\n");
+				/* Shutdown printer unless it is shared */
+				if (!getenv("AG_CONNECT"))
+					fprintf(stream_gcode, "%sM112\n",
+								MSG_CMD_URGENT);
+
 				/* Exit core */
 				fprintf(stream_gcode, "#ag:exit\n\n");
 				fflush(stream_gcode);
 
 				endwin();
 
-				pclose(stream_gcode);
-				pclose(stream_feedback);
-
-				close(pipe_gcode);
+				fclose(stream_gcode);
 				close(pipe_feedback);
 
-/*
-				if (line_feedback)
-					free(line_feedback);
-*/
-
 				wait(&status);
 				printf("core exit = %d\n", status);
 
@@ -667,35 +733,6 @@ int main(int argc, char* argv[]) {
 
 		if (time(NULL) - last_temp > TEMP_PERIOD)
 		{
-			do {
-				nbytes = nonblock_getline(line_feedback, stream_feedback);
-				
-/*
-				nbytes = getline(&line_feedback, &line_feedback_len, stream_feedback);
-
-				fprintf(stream_gcode, "NB %d %s\n", nbytes);
-				fflush(stream_gcode);
-*/
-
-				if (nbytes > 0) {
-					mvprintw(LINES - 3, 0, "nb %d", nbytes);
-					sscanf(line_feedback, "ok T:%u B:%u",
-						&temp_extruder, &temp_bed);
-
-
-					if (nbytes > 66) {
-						line_feedback[63] = '.';
-						line_feedback[64] = '.';
-						line_feedback[65] = '.';
-						line_feedback[66] = '\0';
-					}
-
-					mvprintw(LINES - 2, 0, "Response: %s", line_feedback);
-					print_temperature(temp_extruder, temp_target);
-				}
-
-			} while (nbytes != -1);
-
 			last_temp = time(NULL);
 
 			fprintf(stream_gcode, "M105\n");
@@ -31,7 +31,6 @@
 /* This value is important as it impacts how frequently the extruder moves */
 #define CURSES_TIMEOUT		100
 
-#define LINE_FEEDBACK_LEN	256
 
 #define PANEL_POS_KEYS_X	50
 #define PANEL_POS_KEYS_Y	1
@@ -1,17 +1,31 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <time.h>
 
 #include "popen2.h"
 #include "nbgetline.h"
-#include "stats.h"
+#include "progress.h"
+#include "record.h"
+#include "cache.h"
 #include "protocol.h"
+#include "journal.h"
 #include "austerus-send.h"
 
 
@@ -44,9 +58,10 @@ void print_duration(time_t time)
 
 
 /*
- * Print the status line to the console.
+ * Print the status line to the console. A negative "remaining" is not yet
+ * known.
  */
-void print_status(int pct, int taken, int estimate)
+void print_status(int pct, time_t remaining)
 {
 	int i, j;
 
@@ -60,162 +75,933 @@ void print_status(int pct, int taken, int estimate)
 	for(j = 0; j < BAR_WIDTH - i - 7; j++)
 		printf(" ");
 
-	taken = estimate * pct / 100;
 	printf("] ");
+
+	if (remaining < 0) {
+		printf("estimating        ");
+		return;
+	}
+
+	print_duration(remaining);
+
+	/* Clear the tail of a longer previous duration */
+	printf(" remaining   ");
 }
 
 
 /*
  * Print the status line to the console.
  */
-void print_status_stream(int pct, time_t start)
+void print_status_stream(int pct, time_t remaining)
 {
-	int taken;
-
-	taken = time(NULL) - start;
-
 	printf("%d%% complete (", pct);
 
-	if (pct == 0)
-		printf("unknown");
+	if (remaining < 0)
+		printf("estimating");
 	else
-		print_duration((taken * 100 / pct) - taken);
+		print_duration(remaining);
 
 	printf(" remaining)\n");
 }
 
 
 /*
- * Strip out comments from line.
+ * Print the number of lines printed for input of unknown length.
+ */
+void print_status_lines(int mode, size_t lines)
+{
+	if (mode == NORMAL)
+		printf("\r%lu lines printed", (long unsigned int) lines);
+	else
+		printf("%lu lines printed\n", (long unsigned int) lines);
+}
+
+
+/*
+ * Return the length of the "length" bytes of "line" before any comment.
+ */
+size_t filter_comments(const char *line, size_t length)
+{
+	const char *semicolon = memchr(line, ';', length);
+	const char *paren;
+
+	if (semicolon)
+		length = semicolon - line;
+
+	paren = memchr(line, '(', length);
+
+	if (paren)
+		length = paren - line;
+
+	return length;
+}
+
+
+/*
+ * Print fixed-point "value" with the three decimal places it holds.
+ */
+static void print_fixed(FILE *stream, char prefix, long int value)
+{
+	fprintf(stream, " %c%s%ld.%03ld", prefix, value < 0 ? "-" : "",
+					labs(value) / 1000, labs(value) % 1000);
+}
+
+
+/*
+ * Return a stream of gcode that restores the machine to the state of "m" so
+ * that printing can resume from the line "m" would read next. The print is
+ * assumed to still be on the bed with Z where it stopped, so only X and Y
+ * are homed.
+ */
+FILE *resume_preamble(struct gvm *m)
+{
+	FILE *stream;
+	long int hotend = m->temperature[HEATER_HOTEND];
+	long int bed = m->temperature[HEATER_BED];
+
+	stream = tmpfile();
+
+	if (stream == NULL) {
+		perror("tmpfile");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Heat both heaters together before waiting for either */
+	if (bed > 0) {
+		fprintf(stream, "M140");
+		print_fixed(stream, 'S', bed);
+		fprintf(stream, "\n");
+	}
+
+	if (hotend > 0) {
+		fprintf(stream, "M104");
+		print_fixed(stream, 'S', hotend);
+		fprintf(stream, "\n");
+	}
+
+	if (bed > 0) {
+		fprintf(stream, "M190");
+		print_fixed(stream, 'S', bed);
+		fprintf(stream, "\n");
+	}
+
+	if (hotend > 0) {
+		fprintf(stream, "M109");
+		print_fixed(stream, 'S', hotend);
+		fprintf(stream, "\n");
+	}
+
+	fprintf(stream, "G21\nG90\n");
+
+	/* Take the current Z as the Z the print stopped at and lift clear */
+	fprintf(stream, "G92");
+	print_fixed(stream, 'Z', m->position.z);
+	fprintf(stream, "\nG1");
+	print_fixed(stream, 'Z', m->position.z + RESUME_LIFT);
+	print_fixed(stream, 'F', RESUME_FEEDRATE);
+	fprintf(stream, "\n");
+
+	/* Home X and Y then restore their offsets and the E position */
+	fprintf(stream, "G28 X0 Y0\nG92");
+	print_fixed(stream, 'X', m->offset.x);
+	print_fixed(stream, 'Y', m->offset.y);
+	print_fixed(stream, 'E', m->position.e);
+	fprintf(stream, "\n");
+
+	fprintf(stream, "G1");
+	print_fixed(stream, 'X', m->position.x);
+	print_fixed(stream, 'Y', m->position.y);
+	print_fixed(stream, 'F', RESUME_FEEDRATE);
+	fprintf(stream, "\nG1");
+	print_fixed(stream, 'Z', m->position.z);
+	fprintf(stream, "\n");
+
+	if (m->feedrate > 0) {
+		fprintf(stream, "G1");
+		print_fixed(stream, 'F', m->feedrate);
+		fprintf(stream, "\n");
+	}
+
+	if (m->fan > 0) {
+		fprintf(stream, "M106");
+		print_fixed(stream, 'S', m->fan);
+		fprintf(stream, "\n");
+	} else {
+		fprintf(stream, "M107\n");
+	}
+
+	if (m->mode == MODE_RELATIVE)
+		fprintf(stream, "G91\n");
+
+	rewind(stream);
+
+	return stream;
+}
+
+
+/*
+ * Return true if the line of "stream" starting at "offset" ends at "next", as
+ * it does when the journal it came from was written for the file. "stream" is
+ * left at "next".
+ */
+static bool journal_matches(FILE *stream, unsigned long int offset,
+							unsigned long int next)
+{
+	char *line = NULL;
+	size_t line_len = 0;
+	bool matches;
+
+	matches = fseek(stream, (long)offset, SEEK_SET) == 0 &&
+			getline(&line, &line_len, stream) > 0 &&
+			(unsigned long int)ftell(stream) == next;
+
+	free(line);
+	fseek(stream, (long)next, SEEK_SET);
+
+	return matches;
+}
+
+
+/*
+ * Read the rest of "stream" into memory for "r", for input that cannot be
+ * mapped such as the preamble or a pipe. Returns false on error.
+ */
+static bool mapping_load(struct mapping *r, FILE *stream)
+{
+	long int origin = ftell(stream);
+	size_t size = 0;
+	size_t n;
+	char *data = NULL;
+	char *grown;
+
+	memset(r, 0, sizeof(struct mapping));
+	r->origin = origin == -1 ? 0 : origin;
+
+	do {
+		grown = realloc(data, size + SEND_CHUNK);
+
+		if (grown == NULL) {
+			free(data);
+			return false;
+		}
+
+		data = grown;
+
+		n = fread(data + size, 1, SEND_CHUNK, stream);
+		size += n;
+	} while (n == SEND_CHUNK);
+
+	if (ferror(stream)) {
+		free(data);
+		return false;
+	}
+
+	r->data = data;
+	r->size = size;
+	r->fd = -1;
+
+	return true;
+}
+
+
+/*
+ * Map the file of "stream" for "r", starting from the position of "stream",
+ * or read it if it cannot be mapped. Returns false on error.
+ */
+static bool mapping_open(struct mapping *r, FILE *stream)
+{
+	struct stat st;
+	long int position = ftell(stream);
+	void *map;
+
+	if (position == -1 || fstat(fileno(stream), &st) == -1 ||
+				!S_ISREG(st.st_mode) || st.st_size == 0)
+		return mapping_load(r, stream);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(stream), 0);
+
+	if (map == MAP_FAILED)
+		return mapping_load(r, stream);
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	memset(r, 0, sizeof(struct mapping));
+	r->data = map;
+	r->size = st.st_size;
+	r->position = position;
+	r->mapped = true;
+	r->fd = -1;
+
+	return true;
+}
+
+
+/*
+ * Read "stream" for "r" as it arrives, from its position on. A followed file
+ * is read past its end as it grows. Returns false on error.
+ */
+static bool mapping_stream(struct mapping *r, FILE *stream, bool follow)
+{
+	long int origin = ftell(stream);
+
+	memset(r, 0, sizeof(struct mapping));
+
+	r->data = malloc(SEND_STREAM);
+
+	if (r->data == NULL)
+		return false;
+
+	r->origin = origin == -1 ? 0 : origin;
+	r->capacity = SEND_STREAM;
+	r->follow = follow;
+	r->fd = fileno(stream);
+
+	return true;
+}
+
+
+/*
+ * Read what is available of the input of "r" once poll() finds it readable,
+ * so the input is left blocking for anything sharing it. Returns the number
+ * of bytes read, 0 at the end of the input or of a followed file or -1 on
+ * error.
+ */
+static ssize_t mapping_read(struct mapping *r)
+{
+	ssize_t n;
+
+	n = read(r->fd, (char *)r->data + r->size, r->capacity - r->size);
+
+	if (n > 0)
+		r->size += n;
+	else if (n == 0 && !r->follow)
+		r->fd = -1;
+
+	return n;
+}
+
+
+/*
+ * Drop the lines of "r" already sent to make space for more input. Nothing
+ * gathered from "r" may still be waiting to be written.
+ */
+static void mapping_compact(struct mapping *r)
+{
+	if (r->position == 0)
+		return;
+
+	memmove((char *)r->data, r->data + r->position, r->size - r->position);
+
+	r->origin += r->position;
+	r->size -= r->position;
+	r->position = 0;
+}
+
+
+/*
+ * Release the memory of "r".
+ */
+static void mapping_free(struct mapping *r)
+{
+	if (r->mapped)
+		munmap((void *)r->data, r->size);
+	else
+		free((void *)r->data);
+
+	r->data = NULL;
+}
+
+
+/*
+ * Add "length" bytes at "data" to the writes of "b", extending the last write
+ * when they follow it.
+ */
+static void batch_add(struct batch *b, const char *data, size_t length)
+{
+	struct iovec *last = b->iov + b->count - 1;
+
+	if (b->count > 0 && (const char *)last->iov_base + last->iov_len ==
+								data) {
+		last->iov_len += length;
+	} else {
+		b->iov[b->count].iov_base = (void *)data;
+		b->iov[b->count].iov_len = length;
+		b->count++;
+	}
+
+	b->bytes += length;
+}
+
+
+/*
+ * Add source line "line" to the lines in "p" awaiting acknowledgement.
+ */
+static void pending_push(struct pending *p, unsigned long int line)
+{
+	unsigned long int *grown;
+	size_t i;
+
+	if (p->count == p->capacity) {
+		grown = malloc((p->capacity + SEND_PENDING) *
+						sizeof(unsigned long int));
+
+		if (grown == NULL) {
+			perror("pending");
+			abort();
+		}
+
+		for (i = 0; i < p->count; i++)
+			grown[i] = p->lines[(p->first + i) % p->capacity];
+
+		free(p->lines);
+
+		p->lines = grown;
+		p->capacity += SEND_PENDING;
+		p->first = 0;
+	}
+
+	p->lines[(p->first + p->count) % p->capacity] = line;
+	p->count++;
+}
+
+
+/*
+ * Remove the oldest line awaiting acknowledgement from "p", which must not be
+ * empty, and return its source line.
+ */
+static unsigned long int pending_pop(struct pending *p)
+{
+	unsigned long int line = p->lines[p->first];
+
+	p->first = (p->first + 1) % p->capacity;
+	p->count--;
+
+	return line;
+}
+
+
+/*
+ * Gather the next lines of "r" into "b" for writing to the core, leaving out
+ * comments and blank lines. Lines are written from "r" where they are, and
+ * runs of lines without comments in one write. A #ag:src marker is added
+ * when a line is not where the core expects it from "next_line" and
+ * "next_offset". The source line of each line gathered is added to "p".
+ * Stops once SEND_CHUNK bytes are gathered, "b" is full or only part of a
+ * line has arrived. Returns the number of lines gathered.
+ */
+static size_t batch_fill(struct batch *b, struct mapping *r,
+		unsigned long int *next_line, unsigned long int *next_offset,
+		struct pending *p, int verbose)
+{
+	const char *line, *end;
+	size_t length, content, i;
+	unsigned long int at_line, at_offset;
+	size_t gathered = 0;
+
+	b->count = 0;
+	b->done = 0;
+	b->bytes = 0;
+	b->marked = 0;
+
+	while (r->position < r->size && b->bytes < SEND_CHUNK &&
+			b->count + 3 <= SEND_IOV &&
+			b->marked + SEND_MARKER <= SEND_MARKERS) {
+		line = r->data + r->position;
+		end = memchr(line, '\n', r->size - r->position);
+		length = end ? (size_t)(end - line) : r->size - r->position;
+
+		/* Wait for the rest of a line still arriving */
+		if (!end && r->fd != -1 && length < r->capacity)
+			break;
+
+		at_line = r->line;
+		at_offset = r->origin + r->position;
+
+		r->position += end ? length + 1 : length;
+
+		if (r->line)
+			r->line++;
+
+		content = filter_comments(line, length);
+
+		/* Blank lines are not sent */
+		for (i = 0; i < content; i++)
+			if (!isspace((unsigned char)line[i]))
+				break;
+
+		if (i == content)
+			continue;
+
+		if (at_line != *next_line || at_offset != *next_offset) {
+			b->iov[b->count].iov_base = b->markers + b->marked;
+			b->iov[b->count].iov_len = sprintf(b->markers +
+				b->marked, "%s%lu %lu\n", MSG_CMD_SOURCE,
+				at_line, at_offset);
+			b->marked += b->iov[b->count].iov_len;
+			b->bytes += b->iov[b->count].iov_len;
+			b->count++;
+		}
+
+		/* Whole lines are sent from the file with their newline */
+		if (content == length && end) {
+			batch_add(b, line, length + 1);
+		} else {
+			batch_add(b, line, content);
+			batch_add(b, "\n", 1);
+		}
+
+		*next_line = at_line ? at_line + 1 : 0;
+		*next_offset = at_line ? at_offset + content + 1 : 0;
+
+		pending_push(p, at_line);
+		gathered++;
+
+		if (verbose)
+			printf("SEND: %.*s\n", (int)content, line);
+	}
+
+	return gathered;
+}
+
+
+/*
+ * Write what "fd" will take of the writes waiting in "b". Returns the number
+ * of bytes written or -1 on error, including when "fd" is full (EAGAIN).
  */
-ssize_t filter_comments(char *line)
+static ssize_t batch_write(struct batch *b, int fd)
 {
-	int i = 0;
-	for (i = 0; i < strlen(line) - 1; i++) {
-		if (line[i] == '(' || line[i] == ';') {
-			line[i] = '\n';
-			line[i + 1] = '\0';
+	ssize_t n;
+	ssize_t left;
+
+	n = writev(fd, b->iov + b->done, b->count - b->done);
+
+	for (left = n; left > 0; ) {
+		if ((size_t)left < b->iov[b->done].iov_len) {
+			b->iov[b->done].iov_base =
+				(char *)b->iov[b->done].iov_base + left;
+			b->iov[b->done].iov_len -= left;
+			break;
 		}
+
+		left -= b->iov[b->done].iov_len;
+		b->done++;
 	}
-	return i;
+
+	return n;
 }
 
 
 /*
- * Print gcode from stream_input to austerus-core on stream_gcode.
+ * Read the events waiting on inotify descriptor "watch". Returns true if the
+ * file was closed after writing.
  */
-int print_file(FILE *stream_input, size_t lines, const char *cmd,
-	unsigned int filament, unsigned int *table, int mode, int verbose) {
+static bool follow_closed(int watch)
+{
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1];
+	const struct inotify_event *event;
+	bool closed = false;
+	ssize_t n;
+	ssize_t i;
+
+	while ((n = read(watch, events, sizeof(events))) > 0) {
+		for (i = 0; i < n; i += sizeof(struct inotify_event) +
+								event->len) {
+			event = (const struct inotify_event *)(events + i);
+
+			if (event->mask & IN_CLOSE_WRITE)
+				closed = true;
+		}
+	}
 
-	int pipe_gcode = 0;
-	int pipe_feedback = 0;
+	return closed;
+}
+
+
+/*
+ * Print gcode from stream_input to austerus-core. Progress and time
+ * remaining are taken from the estimated print time in "progress" at the
+ * line of the file last acknowledged, comments and blank lines included. When
+ * resuming "first" lines of the file have already been printed and
+ * stream_input is positioned after them, and any "stream_preamble" lines are
+ * sent before it.
+ *
+ * The file is mapped and gathered into large writes to the core's pipe,
+ * which is kept full while feedback is read from one poll() loop. The exit of
+ * the core is watched for in the same loop through a signalfd, so the print
+ * drains without waking until there is feedback or the core has gone.
+ *
+ * Input that cannot be mapped, such as a pipe, or a file being followed as
+ * it is written, is sent as it arrives. A followed file is complete once its
+ * writer closes it or it has not grown for FOLLOW_IDLE seconds. If the
+ * analysis of "progress" was started but not finished it continues a slice
+ * at a time between polls, with progress estimated from the bytes sent
+ * until then.
+ */
+int print_file(FILE *stream_preamble, FILE *stream_input, const char *cmd,
+	struct progress *progress, size_t first, bool follow, int mode,
+	int verbose) {
 
-	FILE *stream_gcode = NULL;
-	FILE *stream_feedback = NULL;
+	int pipe_gcode = -1;
+	int pipe_feedback = -1;
 
-	int status;
-	time_t start;
+	int status = 0;
+
+	size_t lines = progress->lines;
+	double total = progress->elapsed;
+	double done;
+	int64_t filament;
+	time_t remaining;
 
 	int i;
 
-	char *line = NULL;
-	size_t line_len = 0;
-	ssize_t nbytes = 0;
-	ssize_t fbytes;
-	size_t tally = 0;
-	char line_feedback[1024];
+	/* Preamble then file, and the lines gathered from them for writing */
+	struct mapping regions[2];
+	struct mapping *r;
+	int region = 0, nregions = 0;
+	struct batch *batch;
+	unsigned long int next_line = 1, next_offset = 0;
+
+	/* Size of a whole file known before it is analysed */
+	struct stat st;
+	off_t size = 0;
+	size_t sent = 0;
+
+	/* Followed file at its end, waiting for it to grow */
+	int watch = -1;
+	bool waiting = false;
+	bool closed = false;
+	time_t grown = time(NULL);
+
+	struct linebuf feedback;
+	char *line_feedback;
+	size_t line_feedback_len;
+	ssize_t nread;
+	struct pollfd fds[5];
+	nfds_t nfds;
+	int at_gcode, at_input, at_watch;
+	int timeout;
+
+	/* SIGCHLD is read from "child" while blocked */
+	sigset_t mask, saved;
+	struct signalfd_siginfo info;
+	int child;
+	bool exited = false;
+
+	/* Lines of the file acknowledged, and its last line acknowledged */
+	struct pending pending;
+	size_t tally = first;
+	size_t printed = first;
+	unsigned long int acked;
+	bool finished;
+	bool counted = false;
+	size_t n;
 
 	int pcta = -1, pctb = 0;
 
 	pid_t pid;
 
-	start = time(NULL);
+	batch = malloc(sizeof(struct batch));
 
-	/* Open the input and output streams to austerus-core */
-	pid = popen2(cmd, &pipe_gcode, &pipe_feedback);
+	if (batch == NULL) {
+		perror("batch");
+		abort();
+	}
 
-	/* Make feedback pipe non-blocking */
-	fcntl(pipe_feedback, F_SETFL, O_NONBLOCK);
+	if (stream_preamble) {
+		if (!mapping_load(&(regions[nregions]), stream_preamble)) {
+			perror("preamble");
+			abort();
+		}
 
-	stream_gcode = fdopen(pipe_gcode, "w");
-	stream_feedback = fdopen(pipe_feedback, "r");
+		nregions++;
+	}
+
+	if (fstat(fileno(stream_input), &st) == 0 && S_ISREG(st.st_mode) &&
+								!follow)
+		size = st.st_size;
 
-	if (!stream_gcode) {
-		fprintf(stderr, "unable to open output stream\n");
+	if (size > 0) {
+		if (!mapping_open(&(regions[nregions]), stream_input)) {
+			perror("file error");
+			abort();
+		}
+	} else if (!mapping_stream(&(regions[nregions]), stream_input,
+							follow)) {
+		perror("file error");
 		abort();
 	}
 
-	if (!stream_feedback) {
-		fprintf(stderr, "unable to open feedback stream\n");
+	regions[nregions].line = first + 1;
+	nregions++;
+
+	if (follow) {
+		watch = inotify_init1(IN_NONBLOCK);
+
+		if (watch == -1 || inotify_add_watch(watch, progress->filename,
+					IN_MODIFY | IN_CLOSE_WRITE) == -1) {
+			perror("inotify");
+			abort();
+		}
+	}
+
+	batch->count = 0;
+	batch->done = 0;
+
+	memset(&pending, 0, sizeof(struct pending));
+
+	/* Open the input and output pipes to austerus-core */
+	pid = popen2(cmd, &pipe_gcode, &pipe_feedback);
+
+	/* Both pipes are serviced without blocking */
+	fcntl(pipe_gcode, F_SETFL, O_NONBLOCK);
+	fcntl(pipe_feedback, F_SETFL, O_NONBLOCK);
+
+	/*
+	 * Blocked after the fork so the core does not inherit the mask. A
+	 * core that exits before then is found by the first waitpid().
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &saved);
+
+	child = signalfd(-1, &mask, SFD_NONBLOCK);
+
+	if (child == -1) {
+		perror("signalfd");
 		abort();
 	}
 
+	exited = waitpid(pid, &status, WNOHANG) == pid;
+
+	linebuf_init(&feedback);
+
 	if (mode == NORMAL) {
 		for(i = 0; i < BAR_WIDTH; i++)
 			printf(" ");
 	}
 
-	while (nbytes != -1) {
-		/* Read the next line from file */
-		nbytes = getline(&line, &line_len, stream_input);
-		if (nbytes < 0)
-			break;
+	/* Until the core exits, closing its output */
+	while (!feedback.eof) {
+		/* Gather more lines once the last were written */
+		while (pipe_gcode != -1 && batch->done == batch->count) {
+			if (region == nregions) {
+				/* Leave the core to finish what it has */
+				close(pipe_gcode);
+				pipe_gcode = -1;
+				break;
+			}
 
-		/* Strip out any comments */
-		nbytes = filter_comments(line);
+			r = &(regions[region]);
 
-		if (nbytes == 0)
-			continue;
+			if (r->capacity)
+				mapping_compact(r);
 
-		if (nbytes == 1 && line[0] == '\n')
-			continue;
+			n = batch_fill(batch, r, &next_line, &next_offset,
+							&pending, verbose);
 
-		if (nbytes == 2 && line[0] == '\t' && line[1] == '\n')
-			continue;
+			if (r->line != 0)
+				sent += n;
 
-		/* Write the file to the core */
-		fprintf(stream_gcode, "%s", line);
-		fflush(stream_gcode);
+			if (r->position == r->size && r->fd == -1)
+				region++;
+			else if (batch->count == 0 && r->fd != -1)
+				break;
+		}
 
-		if (verbose)
-			printf("SEND: %s", line);
-
-		/* Read any available feedback lines */
-		do {
-			fbytes = nonblock_getline(line_feedback,
-				stream_feedback);
-			if (fbytes > 0) {
-				if (strncmp(line_feedback, MSG_ACK,
-						MSG_ACK_LEN) == 0 ||
-					strncmp(line_feedback, MSG_DUD,
+		/* Analyse the file a slice at a time while printing it */
+		if (progress->checkpoints && !progress->built &&
+				progress_advance(progress, ANALYSIS_SLICE)) {
+			lines = progress->lines;
+			total = progress->elapsed;
+			pcta = -1;
+
+			if (mode == NORMAL)
+				printf("\r");
+
+			printf("estimated print time: ");
+			print_duration((time_t)total);
+			printf("\n");
+		}
+
+		nfds = 0;
+		at_gcode = -1;
+		at_input = -1;
+		at_watch = -1;
+		timeout = -1;
+
+		fds[nfds].fd = pipe_feedback;
+		fds[nfds].events = POLLIN;
+		nfds++;
+
+		fds[nfds].fd = child;
+		fds[nfds].events = POLLIN;
+		nfds++;
+
+		if (pipe_gcode != -1 && batch->done < batch->count) {
+			at_gcode = nfds;
+			fds[nfds].fd = pipe_gcode;
+			fds[nfds].events = POLLOUT;
+			nfds++;
+		}
+
+		/* Read more input while there is space for it */
+		r = &(regions[nregions - 1]);
+
+		if (r->fd != -1 && waiting) {
+			at_watch = nfds;
+			fds[nfds].fd = watch;
+			fds[nfds].events = POLLIN;
+			nfds++;
+
+			timeout = (FOLLOW_IDLE - (time(NULL) - grown)) * 1000;
+
+			if (timeout < 0)
+				timeout = 0;
+		} else if (r->fd != -1 && r->size < r->capacity) {
+			at_input = nfds;
+			fds[nfds].fd = r->fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		/* Once the core has exited only its last feedback is left */
+		if (exited || (progress->checkpoints && !progress->built))
+			timeout = 0;
+
+		if (poll(fds, nfds, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			abort();
+		}
+
+		if (fds[1].revents) {
+			while (read(child, &info, sizeof(info)) > 0)
+				;
+
+			if (!exited)
+				exited = waitpid(pid, &status, WNOHANG) == pid;
+		}
+
+		if (at_gcode != -1 && fds[at_gcode].revents &&
+				batch_write(batch, pipe_gcode) == -1 &&
+				errno != EAGAIN) {
+			/* A core that has gone still leaves its feedback */
+			if (errno != EPIPE)
+				perror("error writing to core");
+
+			close(pipe_gcode);
+			pipe_gcode = -1;
+		}
+
+		if (at_input != -1 && fds[at_input].revents) {
+			nread = mapping_read(r);
+
+			if (nread > 0) {
+				grown = time(NULL);
+			} else if (nread == 0 && r->follow) {
+				/* At the end of a followed file for now */
+				if (closed)
+					r->fd = -1;
+				else
+					waiting = true;
+			} else if (nread == -1 && errno != EAGAIN) {
+				perror("file error");
+				r->fd = -1;
+			}
+		}
+
+		if (at_watch != -1 && fds[at_watch].revents) {
+			/* Read on to the end once more after the last write */
+			closed = follow_closed(watch) || closed;
+			waiting = false;
+		}
+
+		/* A followed file that stops growing is taken as complete */
+		if (waiting && time(NULL) - grown >= FOLLOW_IDLE)
+			r->fd = -1;
+
+		if (fds[0].revents || exited) {
+			nread = linebuf_fill(&feedback, pipe_feedback);
+
+			if (nread == -1 && errno != EAGAIN) {
+				perror("error reading from core");
+				break;
+			}
+
+			/* Output held open by another process is not waited on */
+			if (exited && nread <= 0)
+				feedback.eof = true;
+		}
+
+		while ((line_feedback = linebuf_next(&feedback,
+						&line_feedback_len))) {
+			if (strncmp(line_feedback, MSG_ACK, MSG_ACK_LEN) == 0 ||
+				strncmp(line_feedback, MSG_DUD,
 						MSG_DUD_LEN) == 0) {
+				/* Acks arrive in order */
+				acked = pending.count ? pending_pop(&pending)
+									: 0;
+
+				if (acked) {
 					tally++;
+					printed = acked;
 				}
-				if (verbose)
-					printf("FEEDBACK: %s\n",
-						line_feedback);
 			}
-		} while (fbytes != -1);
 
-		if (tally > lines) {
+			if (verbose)
+				printf("FEEDBACK: %s\n", line_feedback);
+		}
+
+		finished = region == nregions && pending.count == 0;
+
+		/* Comments and blank lines ending the file are done with it */
+		if (finished && r->line)
+			printed = r->line - 1;
+
+		if (progress->built && printed > lines) {
 			fprintf(stderr, "Expected %lu valid lines, got more\n",
 				(long unsigned int) lines);
-			return 0;
+			break;
 		}
 
-		if (filament == 0)
-			pctb = 0;
-		else
-			pctb = 100 * table[tally] / filament;
+		remaining = -1;
+
+		if (progress->built) {
+			progress_at(progress, printed, &filament, &done);
+
+			if (total <= 0.0)
+				pctb = 0;
+			else
+				pctb = (int)(100.0 * done / total);
+
+			remaining = (time_t)(total - done);
+		} else if (size > 0 && sent > 0) {
+			/* Lines printed of those expected at the density of
+			 * those sent so far */
+			pctb = (int)(100.0 * tally / sent *
+				(r->origin + r->position) / size);
+		} else {
+			pctb = tally / STATUS_LINES;
+		}
+
+		/* The lines printed are counted once more when all are */
+		if (!progress->built && size == 0 && finished && !counted) {
+			counted = true;
+			pcta = -1;
+		}
 
 		if (pcta != pctb) {
 			pcta = pctb;
 
-			if (mode == NORMAL) {
+			if (!progress->built && size == 0) {
+				print_status_lines(mode, tally);
+			} else if (mode == NORMAL) {
 				printf("\r");
-				print_status(pcta, 0, 0);
+				print_status(pcta, remaining);
 			} else {
-				print_status_stream(pcta, start);
+				print_status_stream(pcta, remaining);
 			}
 
 			fflush(stdout);
@@ -225,63 +1011,33 @@ int print_file(FILE *stream_input, size_t lines, const char *cmd,
 	if (mode == NORMAL)
 		printf("\n");
 
-	/*
-	 * Now we have written and flushed all outgoing gcode we can close the
-	 * pipe leaving the core to finish reading the data.
-	 */
-
-	/* Block until stream is closed */
-	if (pclose(stream_gcode) != 0)
-		perror("error closing stream");
+	if (pipe_gcode != -1)
+		close(pipe_gcode);
 
-	close(pipe_gcode);
+	close(pipe_feedback);
 
-	if (wait(&status) != pid)
+	/* The core closes its output as it exits */
+	if (!exited && waitpid(pid, &status, 0) != pid)
 		perror("error waiting for core");
 
-	status = WEXITSTATUS(status);
-
-	/*
-	 * Read any remaining data from the feedback pipe until the core has
-	 * exited.
-	 */
-
-	while (1) {
-		fbytes = nonblock_getline(line_feedback, stream_feedback);
-		if (fbytes == -1) {
-			if (kill(pid, 0) == 0)
-				usleep(100);
-			else
-				break;
-		}
+	close(child);
+	sigprocmask(SIG_SETMASK, &saved, NULL);
 
-		if (fbytes > 0) {
-			if (strncmp(line_feedback, MSG_ACK,
-					MSG_ACK_LEN) == 0 ||
-				strncmp(line_feedback, MSG_DUD,
-					MSG_DUD_LEN) == 0) {
-				tally++;
-			}
-			if (verbose)
-				printf("FEEDBACK (post): %s\n", line_feedback);
+	if (watch != -1)
+		close(watch);
 
-			/*
-			 * TODO We should still be updating progress here */
-		}
-	}
+	status = WEXITSTATUS(status);
 
-	if (tally != lines) {
+	if (progress->built && printed != lines) {
 		fprintf(stderr, "Expected %lu valid lines, got more %lu\n",
-			(long unsigned int) lines, (long unsigned int) tally);
+			(long unsigned int) lines, (long unsigned int) printed);
 	}
 
-	if (pclose(stream_feedback) != 0)
-		perror("error closing stream");
-
-	if (line)
-		free(line);
+	for (i = 0; i < nregions; i++)
+		mapping_free(&(regions[i]));
 
-	close(pipe_feedback);
+	free(pending.lines);
+	free(batch);
 
 	return status;
 }
@@ -299,7 +1055,17 @@ void usage(void)
 	" -p, --port=serialport  Serial port Arduino is on\n"
 	" -b, --baud=baudrate    Baudrate (bps) of Arduino\n"
 	" -c, --ack-count        Set delayed ack count (1 is no delayed ack)\n"
-	" -s, --stream           Run in stream mode\n"
+	" -x, --rx-buffer=bytes  Fill the printer's receive buffer of bytes\n"
+	" -t, --buffer-time=ms   Keep ms of motion queued in the printer\n"
+	" -k, --checksum         Send line numbers and checksums\n");
+
+	printf(" -s, --stream           Run in stream mode\n"
+	" -r, --resume-line=line Resume an interrupted print at line\n"
+	" -j, --resume-journal=file\n"
+	"                        Resume after the last line acknowledged in the\n"
+	"                        journal file\n"
+	" -n, --no-cache         Do not use the analysis cache\n"
+	" -f, --follow           Print files as they are written, until closed\n"
 	" -v, --verbose          Print extra output\n"
 	"\n");
 }
@@ -308,6 +1074,7 @@ void usage(void)
 int main(int argc, char *argv[])
 {
 	FILE *stream_input;
+	FILE *stream_preamble = NULL;
 
 	char *serial_port = NULL;
 	int mode = NORMAL;
@@ -320,9 +1087,23 @@ int main(int argc, char *argv[])
 
 	int i;
 
-	unsigned int *table = NULL;
-	size_t lines = 0;
-	float filament = 0.0;
+	struct progress progress;
+	struct gvm *m;
+	size_t resume = 0;
+	char *end;
+
+	char *journal = NULL;
+	uint64_t journal_line;
+	uint64_t journal_offset;
+
+	struct cache cache;
+	bool caching = true;
+	bool cached;
+	bool hit;
+
+	/* Input read as it arrives from a pipe or a file still being written */
+	bool follow = false;
+	bool streamed;
 
 	/* Read command line options */
 	int option_index = 0, opt = 0;
@@ -331,7 +1112,14 @@ int main(int argc, char *argv[])
 		{"port", required_argument, 0, 'p'},
 		{"baud", required_argument, 0, 'b'},
 		{"ack-count", required_argument, 0, 'c'},
+		{"rx-buffer", required_argument, 0, 'x'},
+		{"buffer-time", required_argument, 0, 't'},
+		{"checksum", no_argument, 0, 'k'},
 		{"stream", no_argument, 0, 's'},
+		{"resume-line", required_argument, 0, 'r'},
+		{"resume-journal", required_argument, 0, 'j'},
+		{"no-cache", no_argument, 0, 'n'},
+		{"follow", no_argument, 0, 'f'},
 		{"verbose", no_argument, 0, 'v'}
 	};
 
@@ -339,7 +1127,7 @@ int main(int argc, char *argv[])
 	asprintf(&cmd, "/usr/bin/env PATH=$PWD:$PATH");
 
 	while(opt >= 0) {
-		opt = getopt_long(argc, argv, "hp:b:c:sv", loptions,
+		opt = getopt_long(argc, argv, "hp:b:c:x:t:ksr:j:nfv", loptions,
 			&option_index);
 
 		switch (opt) {
@@ -359,9 +1147,39 @@ int main(int argc, char *argv[])
 				asprintf(&cmd, "%s AG_ACKCOUNT=%ld", cmd,
 					strtol(optarg, NULL, 10));
 				break;
+			case 'x':
+				asprintf(&cmd, "%s AG_RXBUFFER=%ld", cmd,
+					strtol(optarg, NULL, 10));
+				break;
+			case 't':
+				asprintf(&cmd, "%s AG_BUFFERTIME=%ld", cmd,
+					strtol(optarg, NULL, 10));
+				break;
+			case 'k':
+				asprintf(&cmd, "%s AG_CHECKSUM=1", cmd);
+				break;
 			case 's':
 				mode = STREAM;
 				break;
+			case 'r':
+				resume = strtoul(optarg, &end, 10);
+
+				if (resume == 0 || *end != '\0') {
+					fprintf(stderr, "invalid resume line "
+							"%s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+			case 'j':
+				journal = optarg;
+				break;
+			case 'n':
+				caching = false;
+				break;
+			case 'f':
+				follow = true;
+				break;
 			case 'v':
 				verbose = 1;
 				asprintf(&cmd, "%s AG_VERBOSE=1", cmd);
@@ -369,35 +1187,148 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!serial_port & !getenv("AG_SERIALPORT")) {
+	/* A core listening on AG_CONNECT already has the port open */
+	if (!serial_port & !getenv("AG_SERIALPORT") && !getenv("AG_CONNECT")) {
 		fprintf(stderr, "A serial port must be specified\n");
 		return EXIT_FAILURE;
 	}
 
+	/* The line to resume from belongs to one file */
+	if ((resume > 0 || journal) && argc - optind > 1) {
+		fprintf(stderr, "only one file can be resumed\n");
+		return EXIT_FAILURE;
+	}
+
 	asprintf(&cmd, "%s austerus-core", cmd);
 
+	/* A core that exits early is seen as EPIPE rather than killing us */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Resume after the last line the printer acknowledged */
+	if (journal) {
+		if (!journal_read(journal, &journal_line, &journal_offset)) {
+			fprintf(stderr, "no acknowledged line in journal %s\n",
+								journal);
+			return EXIT_FAILURE;
+		}
+
+		resume = journal_line + 1;
+	}
+
 	for (i = optind; i < argc; i++) {
 		printf("starting print: %s\n", argv[i]);
 		fflush(stdout);
 
-		filament = get_progress_table(&table, &lines, argv[i]);
+		/* Standard input and followed files can only be read once */
+		streamed = follow || strcmp(argv[i], "-") == 0;
+
+		if (streamed && resume > 0) {
+			fprintf(stderr, "cannot resume streamed input\n");
+			return EXIT_FAILURE;
+		}
+
+		if (!streamed && record_probe(argv[i])) {
+			fprintf(stderr, "compiled gcode cannot be printed\n");
+			return EXIT_FAILURE;
+		}
+
+		cached = caching && !streamed &&
+					cache_open(&cache, argv[i]) == 0;
+		hit = false;
+
+		progress_init(&progress, argv[i]);
+
+		if (cached)
+			hit = cache_get_progress(&cache, &progress);
+
+		/* Resuming looks up the line to resume from first, otherwise
+		 * the file is analysed as it prints */
+		if (!hit && !streamed && resume > 0) {
+			progress_build(&progress);
+
+			if (cached && progress.lines > 0)
+				cache_put_progress(&cache, &progress);
+
+			hit = true;
+		} else if (!hit && !streamed) {
+			progress_start(&progress);
+		}
 
-		if (lines == 0) {
+		if (progress.built && progress.lines == 0) {
 			fprintf(stderr, "file contains no lines\n");
 			return EXIT_FAILURE;
 		}
 
-		printf("total filament length: %fmm\n", filament);
+		if (progress.built) {
+			printf("total filament length: %fmm\n",
+					(double)progress.filament / 1000.0);
+			printf("estimated print time: ");
+			print_duration((time_t)progress.elapsed);
+			printf("\n");
+		}
 
-		stream_input = fopen(argv[i], "r");
+		if (strcmp(argv[i], "-") == 0)
+			stream_input = stdin;
+		else
+			stream_input = fopen(argv[i], "r");
 
 		if (stream_input == NULL) {
 			fprintf(stderr, "file error\n");
 			return EXIT_FAILURE;
 		}
 
-		rc = print_file(stream_input, lines, cmd,
-			(unsigned int) filament, table, mode, verbose);
+		if (resume > 0) {
+			if (journal && resume == progress.lines + 1) {
+				printf("print already completed\n");
+				fclose(stream_input);
+				progress_free(&progress);
+
+				if (cached)
+					cache_close(&cache);
+
+				continue;
+			}
+
+			if (resume > progress.lines) {
+				fprintf(stderr, "file has no line %lu\n",
+						(long unsigned int) resume);
+				return EXIT_FAILURE;
+			}
+
+			/* The state before the resume line is the state after
+			 * the lines already printed */
+			m = progress_seek(&progress, resume - 1);
+
+			if (!m->located) {
+				fprintf(stderr, "cannot resume before homing\n");
+				return EXIT_FAILURE;
+			}
+
+			if (fseek(stream_input, (long)gvm_get_offset(m),
+							SEEK_SET) == -1) {
+				perror("fseek");
+				return EXIT_FAILURE;
+			}
+
+			if (journal && !journal_matches(stream_input,
+					journal_offset, gvm_get_offset(m))) {
+				fprintf(stderr, "file does not match journal\n");
+				return EXIT_FAILURE;
+			}
+
+			stream_preamble = resume_preamble(m);
+
+			printf("resuming print at line %lu\n",
+						(long unsigned int) resume);
+		}
+
+		rc = print_file(stream_preamble, stream_input, cmd, &progress,
+				resume ? resume - 1 : 0, follow, mode, verbose);
+
+		if (stream_preamble) {
+			fclose(stream_preamble);
+			stream_preamble = NULL;
+		}
 
 		if (rc != 0) {
 			if (rc > status)
@@ -410,7 +1341,14 @@ int main(int argc, char *argv[])
 
 		printf("completed print: %s\n", argv[i]);
 
-		free(table);
+		/* Keep an analysis finished while printing */
+		if (cached && !hit && progress.built && progress.lines > 0)
+			cache_put_progress(&cache, &progress);
+
+		progress_free(&progress);
+
+		if (cached)
+			cache_close(&cache);
 	}
 
 	free(cmd);
@@ -3,10 +3,90 @@
 #define BAR_WIDTH		35
 #define PIPE_LINE_BUFFER_LEN	100
 
+/* Height in um to lift clear of the print and feedrate in um/min to move at
+ * while restoring position to resume it */
+#define RESUME_LIFT		5000
+#define RESUME_FEEDRATE		3000000
+
+/* Bytes of gcode gathered for each write to the core, the most separate
+ * pieces in one write and the space for the #ag:src markers among them */
+#define SEND_CHUNK		65536
+#define SEND_IOV		256
+#define SEND_MARKER		64
+#define SEND_MARKERS		(SEND_IOV / 2 * SEND_MARKER)
+
+/* Bytes held of input read as it arrives, from a pipe or a followed file */
+#define SEND_STREAM		(4 * SEND_CHUNK)
+
+/* Seconds a followed file may go without growing before it is complete */
+#define FOLLOW_IDLE		30
+
+/* Lines analysed for progress between polls while printing */
+#define ANALYSIS_SLICE		4096
+
+/* Lines between status updates when the length of the print is unknown */
+#define STATUS_LINES		1000
+
+/* Lines of room added for lines awaiting acknowledgement when it runs out */
+#define SEND_PENDING		4096
+
+
+/*
+ * Gcode to send, mapped or read into "data" with "position" the offset of the
+ * next line. "origin" is the offset in its file of data[0] and "line" the
+ * number of the next line, or 0 for lines not from the file. Input still
+ * arriving is read from "fd" into the "capacity" bytes of "data" as it is
+ * sent, and "fd" is -1 once all of it has been read. A followed file is read
+ * past its end as it grows.
+ */
+struct mapping {
+	const char *data;
+	size_t size;
+	size_t position;
+	unsigned long int origin;
+	unsigned long int line;
+	bool mapped;
+
+	int fd;
+	size_t capacity;
+	bool follow;
+};
+
+
+/*
+ * Lines gathered from a region for writing to the core in one go. Writes from
+ * "done" on are still to be written and "markers" holds the text of the
+ * #ag:src markers written among them.
+ */
+struct batch {
+	struct iovec iov[SEND_IOV];
+	int count;
+	int done;
+	size_t bytes;
+	char markers[SEND_MARKERS];
+	size_t marked;
+};
+
+
+/*
+ * Source lines of the lines written to the core that are not yet
+ * acknowledged, oldest first, in a ring of "capacity" that grows as needed.
+ * Lines not from the file are 0.
+ */
+struct pending {
+	unsigned long int *lines;
+	size_t capacity;
+	size_t first;
+	size_t count;
+};
+
 
 void print_time(int seconds);
-void print_status(int pct, int taken, int estimate);
-ssize_t filter_comments(char *line);
-int print_file(FILE *stream_input, size_t lines, const char *cmd,
-	unsigned int filament, unsigned int *table, int mode, int verbose);
+void print_status(int pct, time_t remaining);
+void print_status_lines(int mode, size_t lines);
+size_t filter_comments(const char *line, size_t length);
+FILE *resume_preamble(struct gvm *m);
+int print_file(FILE *stream_preamble, FILE *stream_input, const char *cmd,
+	struct progress *progress, size_t first, bool follow, int mode,
+	int verbose);
 int main();
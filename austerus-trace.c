@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+
+/*
+ * Print usage to terminal
+ */
+static void usage(void)
+{
+	printf("Usage: austerus-trace [OPTION]... [FILE]\n"
+	"\n"
+	"Options:\n"
+	" -h, --help             Print this help message\n"
+	" -i, --interval=secs    Seconds per row of throughput over time\n"
+	" -s, --stall=ms         Shortest gap with no line in flight to report\n"
+	"\n");
+}
+
+
+/*
+ * Order doubles for qsort().
+ */
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/*
+ * Print the 50th, 90th and 99th percentiles and maximum of the "count" values
+ * in "values" as a row labelled "label", sorting them.
+ */
+static void print_percentiles(const char *label, double *values, size_t count)
+{
+	const double percents[] = {0.5, 0.9, 0.99, 1.0};
+	size_t i, rank;
+
+	printf("%-16s", label);
+
+	if (count == 0) {
+		printf("%10s%10s%10s%10s\n", "-", "-", "-", "-");
+		return;
+	}
+
+	qsort(values, count, sizeof(double), compare_double);
+
+	for (i = 0; i < sizeof(percents) / sizeof(double); i++) {
+		rank = (size_t)(percents[i] * count + 0.999999);
+
+		if (rank < 1)
+			rank = 1;
+
+		printf("%10.3f", values[rank - 1]);
+	}
+
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct trace_record *records;
+	const struct trace_record *r;
+	size_t count = 0;
+	size_t i, n;
+
+	/* Latencies in milliseconds */
+	double *queued, *printer, *total;
+	size_t queued_n = 0, printer_n = 0, total_n = 0;
+
+	int64_t start, end, busy;
+	size_t lost = 0;
+
+	/* Gaps with no line in flight */
+	unsigned long int stalls = 0;
+	int64_t stalled = 0;
+	int64_t longest = 0;
+	int64_t longest_at = 0;
+
+	/* Lines acknowledged per interval */
+	unsigned long int *acked;
+	size_t intervals;
+
+	double interval = 10.0;
+	double stall = 100.0;
+
+	int option_index = 0, opt=0;
+	static struct option loptions[] = {
+		{"help", no_argument, 0, 'h'},
+		{"interval", required_argument, 0, 'i'},
+		{"stall", required_argument, 0, 's'}
+	};
+
+	while(opt >= 0) {
+		opt = getopt_long(argc, argv, "hi:s:", loptions,
+							&option_index);
+
+		switch (opt) {
+			case 'h':
+				usage();
+				return EXIT_SUCCESS;
+			case 'i':
+				interval = strtod(optarg, NULL);
+				break;
+			case 's':
+				stall = strtod(optarg, NULL);
+				break;
+		}
+	}
+
+	if (argc - optind != 1 || interval <= 0.0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	records = trace_load(argv[optind], &count);
+
+	if (records == NULL) {
+		fprintf(stderr, "%s is not a trace\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (count == 0) {
+		printf("no lines traced\n");
+		free(records);
+		return EXIT_SUCCESS;
+	}
+
+	queued = malloc(count * sizeof(double));
+	printer = malloc(count * sizeof(double));
+	total = malloc(count * sizeof(double));
+
+	if (queued == NULL || printer == NULL || total == NULL) {
+		perror("Error: trace");
+		return EXIT_FAILURE;
+	}
+
+	/* Records are in the order lines were acknowledged, as written */
+	start = records[0].read ? records[0].read : records[0].written;
+	end = start;
+	busy = start;
+
+	for (i = 0; i < count; i++) {
+		r = &(records[i]);
+
+		if (r->flags & TRACE_LOST) {
+			lost++;
+			continue;
+		}
+
+		if (r->read && r->read < start)
+			start = r->read;
+
+		if (r->acked > end)
+			end = r->acked;
+
+		if (r->read && r->written)
+			queued[queued_n++] = (r->written - r->read) / 1000.0;
+
+		if (r->written)
+			printer[printer_n++] = (r->acked - r->written) / 1000.0;
+
+		if (r->read)
+			total[total_n++] = (r->acked - r->read) / 1000.0;
+
+		if (r->written == 0)
+			continue;
+
+		if (r->written - busy >= stall * 1000.0) {
+			stalls++;
+			stalled += r->written - busy;
+
+			if (r->written - busy > longest) {
+				longest = r->written - busy;
+				longest_at = busy;
+			}
+		}
+
+		if (r->acked > busy)
+			busy = r->acked;
+	}
+
+	printf("lines           %10lu\n", (unsigned long)(count - lost));
+	printf("lost            %10lu\n", (unsigned long)lost);
+	printf("duration        %10.3fs\n", (end - start) / 1000000.0);
+	printf("throughput      %10.1f lines/s\n", end > start ?
+		(count - lost) * 1000000.0 / (end - start) : 0.0);
+
+	printf("\n%-16s%10s%10s%10s%10s\n", "latency (ms)", "p50", "p90",
+								"p99", "max");
+	print_percentiles("queued", queued, queued_n);
+	print_percentiles("printer", printer, printer_n);
+	print_percentiles("total", total, total_n);
+
+	printf("\nstalls over %.0fms: %lu, %.3fs in total", stall, stalls,
+							stalled / 1000000.0);
+
+	if (stalls > 0)
+		printf(", longest %.3fs at %.3fs", longest / 1000000.0,
+					(longest_at - start) / 1000000.0);
+
+	printf("\n");
+
+	/* Throughput over time */
+	intervals = (size_t)((end - start) / (interval * 1000000.0)) + 1;
+	acked = calloc(intervals, sizeof(unsigned long int));
+
+	if (acked == NULL) {
+		perror("Error: trace");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (records[i].flags & TRACE_LOST)
+			continue;
+
+		n = (size_t)((records[i].acked - start) /
+						(interval * 1000000.0));
+
+		if (n < intervals)
+			acked[n]++;
+	}
+
+	printf("\ntime\tlines/s\n");
+
+	for (n = 0; n < intervals; n++)
+		printf("%.1f\t%.1f\n", n * interval, acked[n] / interval);
+
+	free(acked);
+	free(queued);
+	free(printer);
+	free(total);
+	free(records);
+
+	return EXIT_SUCCESS;
+}
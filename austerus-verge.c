@@ -5,7 +5,10 @@
 #include <getopt.h>
 #include <string.h>
 
+#include "scan.h"
 #include "stats.h"
+#include "progress.h"
+#include "cache.h"
 
 
 static float read_part(char *arg)
@@ -32,7 +35,11 @@ static void usage(void)
 	" -h, --help             Print this help message\n"
 	" -d, --deposition       Bounds of deposited material\n"
 	" -p, --physical         Track physical location not axis values\n"
-	" -z, --zmin=zmin        Track bounds travelled while Z less than\n"
+	" -z, --zmin=zmin        Track bounds travelled while Z less than\n");
+
+	printf(" -t, --time             Also print the estimated print time\n"
+	" -j, --jobs=jobs        Analyse in parallel (0 for all processors)\n"
+	" -n, --no-cache         Do not use the analysis cache\n"
 	" -v, --verbose          Explain what is being done\n"
 	"\n");
 }
@@ -52,6 +59,14 @@ int main(int argc, char *argv[])
 	struct region *ignore = NULL;
 
 	bool verbose = false;
+	unsigned int jobs = 1;
+
+	bool timing = false;
+	struct progress progress;
+
+	struct cache cache;
+	bool caching = true;
+	bool cached;
 
 	int option_index = 0, opt=0;
 	static struct option loptions[] = {
@@ -60,11 +75,14 @@ int main(int argc, char *argv[])
 		{"physical", no_argument, 0, 'p'},
 		{"zmin", required_argument, 0, 'z'},
 		{"ignore", required_argument, 0, 'i'},
+		{"time", no_argument, 0, 't'},
+		{"jobs", required_argument, 0, 'j'},
+		{"no-cache", no_argument, 0, 'n'},
 		{"verbose", no_argument, 0, 'v'}
 	};
 
 	while(opt >= 0) {
-		opt = getopt_long(argc, argv, "hdpz:i:v", loptions, &option_index);
+		opt = getopt_long(argc, argv, "hdpz:i:tj:nv", loptions, &option_index);
 
 		switch (opt) {
 			case 'h':
@@ -88,6 +106,18 @@ int main(int argc, char *argv[])
 
 				ignore = &head;
 				break;
+			case 't':
+				timing = true;
+				break;
+			case 'j':
+				jobs = strtoul(optarg, NULL, 10);
+
+				if (jobs == 0)
+					jobs = scan_jobs();
+				break;
+			case 'n':
+				caching = false;
+				break;
 			case 'v':
 				verbose = true;
 				break;
@@ -102,8 +132,31 @@ int main(int argc, char *argv[])
 
 	bounds_clear(&bounds);
 
-	lines = get_extends(&bounds, deposition, physical, zmode, zmin,
-		ignore, verbose, argv[optind]);
+	/* Verbose runs always analyse */
+	cached = caching && !verbose && cache_open(&cache, argv[optind]) == 0;
+
+	/* Only the extends of the plain modes are cached */
+	if (!cached || zmode || ignore || !cache_get_extends(&cache, &bounds,
+					&lines, deposition, physical)) {
+		lines = get_extends(&bounds, deposition, physical, zmode, zmin,
+			ignore, verbose, argv[optind], jobs);
+
+		if (cached && !zmode && !ignore && lines > 0)
+			cache_put_extends(&cache, &bounds, lines, deposition,
+								physical);
+	}
+
+	progress_init(&progress, argv[optind]);
+
+	if (timing && (!cached || !cache_get_progress(&cache, &progress))) {
+		progress_build(&progress);
+
+		if (cached && progress.lines > 0)
+			cache_put_progress(&cache, &progress);
+	}
+
+	if (cached)
+		cache_close(&cache);
 
 	if (lines == 0) {
 		fprintf(stderr, "read no lines\n");
@@ -121,5 +174,10 @@ int main(int argc, char *argv[])
 		printf("E\t%f\t%f\n", (float)bounds.e.min / 1000.0,
 						(float)bounds.e.max / 1000.0);
 
+	if (timing)
+		printf("T\t%f\t%f\n", 0.0, progress.elapsed);
+
+	progress_free(&progress);
+
 	return EXIT_SUCCESS;
 }
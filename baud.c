@@ -0,0 +1,52 @@
+/*
+ * Arbitrary baud rates use the Linux termios2 interface, which cannot be
+ * included alongside <termios.h> so is kept apart from serial.c.
+ */
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+#include <asm/termbits.h>
+#endif
+
+#include "baud.h"
+
+
+/*
+ * Set serial port "serial" to "baud" bps whether or not it is one of the
+ * standard rates. Returns -1 if the rate cannot be set.
+ */
+int baud_set(int serial, int baud)
+{
+#if defined(TCGETS2) && defined(BOTHER)
+	struct termios2 options;
+
+	if (ioctl(serial, TCGETS2, &options) == -1)
+		return -1;
+
+	options.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	options.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	options.c_ispeed = baud;
+	options.c_ospeed = baud;
+
+	if (ioctl(serial, TCSETS2, &options) == -1)
+		return -1;
+
+	/* Drivers may round to the nearest rate they can generate */
+	if (ioctl(serial, TCGETS2, &options) == -1)
+		return -1;
+
+	if (options.c_ospeed == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+#else
+	(void)serial;
+	(void)baud;
+
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
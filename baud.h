@@ -0,0 +1,6 @@
+#ifndef H_BAUD
+#define H_BAUD
+
+int baud_set(int serial, int baud);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE /* sockets */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "nbgetline.h"
+#include "broker.h"
+
+
+/*
+ * Fill "addr" with the address of Unix socket "path". Returns -1 if the path
+ * is too long.
+ */
+static int broker_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+
+/*
+ * Remove Unix socket "path" if it was left by a core that did not exit
+ * cleanly, which no one is listening on any more. Returns -1 with errno set
+ * to EADDRINUSE if a core is still listening on it.
+ */
+static int broker_stale(struct sockaddr_un *addr, const char *path)
+{
+	struct stat st;
+	int fd;
+	int rc;
+
+	if (stat(path, &st) == -1 || !S_ISSOCK(st.st_mode))
+		return 0;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		return -1;
+
+	rc = connect(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_un));
+
+	if (rc == 0) {
+		close(fd);
+		errno = EADDRINUSE;
+		return -1;
+	}
+
+	/* Anything else is left for bind() to report */
+	if (errno == ECONNREFUSED)
+		unlink(path);
+
+	close(fd);
+
+	return 0;
+}
+
+
+/*
+ * Listen for clients on Unix socket "path", replacing a socket left by a core
+ * that did not exit cleanly but not one a core is still listening on. Returns
+ * the non-blocking listening descriptor or -1 on error.
+ */
+int broker_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (broker_address(&addr, path) == -1)
+		return -1;
+
+	if (broker_stale(&addr, path) == -1)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+						listen(fd, 4) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+
+/*
+ * Accept a client waiting on "listener". Returns its non-blocking descriptor
+ * or -1 on error, including when none is waiting (EAGAIN).
+ */
+int broker_accept(int listener)
+{
+	int fd;
+
+	fd = accept(listener, NULL, NULL);
+
+	if (fd != -1)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+
+/*
+ * Connect to the core listening on Unix socket "path" and copy standard input
+ * to it and its feedback to standard output, so a client sees the same
+ * streams as from a core of its own. The end of standard input is passed on
+ * and the relay exits when the core closes the connection after the last
+ * acknowledgement. Returns the exit status.
+ */
+int broker_relay(const char *path)
+{
+	struct sockaddr_un addr;
+	struct linebuf up;
+	struct linebuf down;
+	struct pollfd fds[3];
+	nfds_t nfds, i;
+	ssize_t n;
+	int sock;
+	bool shut = false;
+
+	if (broker_address(&addr, path) == -1) {
+		perror("Error: unable to connect to core");
+		return EXIT_FAILURE;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (sock == -1 ||
+		connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("Error: unable to connect to core");
+		return EXIT_FAILURE;
+	}
+
+	/* Standard input is shared, and only read once found readable */
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	linebuf_init(&up);
+	linebuf_init(&down);
+
+	while (!down.eof || linebuf_length(&down) > 0) {
+		nfds = 0;
+
+		if (!up.eof && linebuf_space(&up) > 0) {
+			fds[nfds].fd = STDIN_FILENO;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		/*
+		 * A closed connection always reports POLLHUP, so the socket
+		 * is only polled for what can be done with it.
+		 */
+		fds[nfds].fd = sock;
+		fds[nfds].events = 0;
+
+		if (!down.eof && linebuf_space(&down) > 0)
+			fds[nfds].events |= POLLIN;
+
+		if (linebuf_length(&up) > 0)
+			fds[nfds].events |= POLLOUT;
+
+		if (fds[nfds].events)
+			nfds++;
+
+		if (linebuf_length(&down) > 0) {
+			fds[nfds].fd = STDOUT_FILENO;
+			fds[nfds].events = POLLOUT;
+			nfds++;
+		}
+
+		if (poll(fds, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("Error: poll");
+			return EXIT_FAILURE;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			if (fds[i].fd == STDIN_FILENO) {
+				n = linebuf_fill(&up, STDIN_FILENO);
+
+				if (n == -1 && errno != EAGAIN) {
+					perror("Error: read error");
+					return EXIT_FAILURE;
+				}
+
+				continue;
+			}
+
+			if (fds[i].fd == STDOUT_FILENO) {
+				n = linebuf_flush(&down, STDOUT_FILENO,
+								LINEBUF_LEN);
+
+				if (n == -1 && errno != EAGAIN) {
+					perror("Error: write error");
+					return EXIT_FAILURE;
+				}
+
+				continue;
+			}
+
+			/* Feedback waits in the socket while "down" is full */
+			if (fds[i].revents & (POLLIN | POLLERR | POLLHUP) &&
+					!down.eof && linebuf_space(&down) > 0) {
+				n = linebuf_fill(&down, sock);
+
+				if (n == -1 && errno != EAGAIN &&
+							errno != ENOBUFS) {
+					perror("Error: core read error");
+					return EXIT_FAILURE;
+				}
+			}
+
+			if (fds[i].revents & POLLOUT) {
+				n = linebuf_flush(&up, sock, LINEBUF_LEN);
+
+				if (n == -1 && errno != EAGAIN) {
+					perror("Error: core write error");
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		/* Pass on the end of input once all of it has been sent */
+		if (up.eof && linebuf_length(&up) == 0 && !shut) {
+			if (shutdown(sock, SHUT_WR) == -1 &&
+							errno != ENOTCONN) {
+				perror("Error: core write error");
+				return EXIT_FAILURE;
+			}
+
+			shut = true;
+		}
+	}
+
+	close(sock);
+
+	return EXIT_SUCCESS;
+}
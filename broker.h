@@ -0,0 +1,8 @@
+#ifndef H_BROKER
+#define H_BROKER
+
+int broker_listen(const char *path);
+int broker_accept(int listener);
+int broker_relay(const char *path);
+
+#endif
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE /* asprintf, mkstemp */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "stats.h"
+#include "progress.h"
+#include "cache.h"
+
+
+/*
+ * Hash "length" bytes of "data" a word at a time.
+ */
+static uint64_t cache_hash(const unsigned char *data, size_t length)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325) ^ length;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		memcpy(&word, data + i, sizeof(uint64_t));
+		hash = (hash ^ word) * UINT64_C(0x100000001b3);
+		hash ^= hash >> 29;
+	}
+
+	word = 0;
+	memcpy(&word, data + i, length - i);
+	hash = (hash ^ word) * UINT64_C(0x100000001b3);
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+
+/*
+ * Create directory "path" and any missing parents.
+ */
+static int cache_mkdir(char *path)
+{
+	char *cursor;
+
+	for (cursor = path + 1; *cursor; cursor++) {
+		if (*cursor != '/')
+			continue;
+
+		*cursor = '\0';
+
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			*cursor = '/';
+			return -1;
+		}
+
+		*cursor = '/';
+	}
+
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Return the cache directory, creating it if required, or NULL if caching is
+ * disabled. AG_CACHE overrides the default and may be empty to disable the
+ * cache.
+ */
+static char *cache_dir(void)
+{
+	char *dir = NULL;
+	const char *base;
+
+	if ((base = getenv("AG_CACHE"))) {
+		if (*base == '\0')
+			return NULL;
+
+		dir = strdup(base);
+	} else if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+		if (asprintf(&dir, "%s/austerusG", base) == -1)
+			dir = NULL;
+	} else if ((base = getenv("HOME"))) {
+		if (asprintf(&dir, "%s/.cache/austerusG", base) == -1)
+			dir = NULL;
+	}
+
+	if (dir && cache_mkdir(dir) == -1) {
+		free(dir);
+		dir = NULL;
+	}
+
+	return dir;
+}
+
+
+/*
+ * Release the mapped entry.
+ */
+static void cache_unmap(struct cache *c)
+{
+	if (c->map)
+		munmap(c->map, c->length);
+
+	c->map = NULL;
+	c->length = 0;
+	c->header = NULL;
+	c->checkpoints = NULL;
+}
+
+
+/*
+ * Map the entry for the key in "c" if it exists and is valid.
+ */
+static void cache_map(struct cache *c)
+{
+	const struct cache_header *header;
+	struct stat st;
+	size_t length;
+	int fd;
+
+	fd = open(c->path, O_RDONLY);
+
+	if (fd == -1)
+		return;
+
+	if (fstat(fd, &st) == -1 ||
+			st.st_size < (off_t)sizeof(struct cache_header)) {
+		close(fd);
+		return;
+	}
+
+	c->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return;
+	}
+
+	c->length = st.st_size;
+	header = (const struct cache_header *)c->map;
+
+	length = sizeof(struct cache_header);
+
+	if (header->flags & CACHE_PROGRESS)
+		length += header->checkpoints * sizeof(struct checkpoint);
+
+	if (memcmp(header->magic, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0 ||
+			header->version != CACHE_VERSION ||
+			header->hash != c->hash ||
+			header->size != c->size ||
+			header->mtime != c->mtime ||
+			length != c->length) {
+		cache_unmap(c);
+		return;
+	}
+
+	c->header = header;
+	c->checkpoints = (const struct checkpoint *)(c->map +
+						sizeof(struct cache_header));
+}
+
+
+/*
+ * Replace the entry with "header" and "checkpoints".
+ */
+static void cache_write(struct cache *c, struct cache_header *header,
+				const struct checkpoint *checkpoints)
+{
+	FILE *stream;
+	char *temp;
+	bool ok;
+	int fd;
+
+	if (asprintf(&temp, "%s.XXXXXX", c->path) == -1)
+		return;
+
+	fd = mkstemp(temp);
+
+	if (fd == -1) {
+		free(temp);
+		return;
+	}
+
+	stream = fdopen(fd, "w");
+
+	if (stream == NULL) {
+		close(fd);
+		unlink(temp);
+		free(temp);
+		return;
+	}
+
+	ok = fwrite(header, sizeof(struct cache_header), 1, stream) == 1;
+
+	if (ok && header->flags & CACHE_PROGRESS)
+		ok = fwrite(checkpoints, sizeof(struct checkpoint),
+				header->checkpoints, stream) ==
+							header->checkpoints;
+
+	if (fclose(stream) != 0)
+		ok = false;
+
+	if (!ok || rename(temp, c->path) == -1)
+		unlink(temp);
+
+	free(temp);
+
+	/* Map the new entry so later updates build on it */
+	cache_unmap(c);
+	cache_map(c);
+}
+
+
+/*
+ * Start a header for an update of the entry.
+ */
+static void cache_header_init(struct cache *c, struct cache_header *header)
+{
+	if (c->header) {
+		*header = *(c->header);
+		return;
+	}
+
+	memset(header, 0, sizeof(struct cache_header));
+	memcpy(header->magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+	header->version = CACHE_VERSION;
+	header->hash = c->hash;
+	header->size = c->size;
+	header->mtime = c->mtime;
+}
+
+
+/*
+ * Return the index of the extends of a verge mode.
+ */
+static int cache_mode(bool deposition, bool physical)
+{
+	return (deposition ? 2 : 0) + (physical ? 1 : 0);
+}
+
+
+/*
+ * Look up the cache entry for gcode file "filename". Returns -1 if caching is
+ * disabled or not possible for the file. Otherwise returns 0 and maps the
+ * entry, if there is one, for the cache_get functions.
+ */
+int cache_open(struct cache *c, const char *filename)
+{
+	struct stat st;
+	void *data;
+	char *dir;
+	int fd;
+
+	memset(c, 0, sizeof(struct cache));
+
+	dir = cache_dir();
+
+	if (dir == NULL)
+		return -1;
+
+	fd = open(filename, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+							st.st_size == 0) {
+		if (fd != -1)
+			close(fd);
+
+		free(dir);
+		return -1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		free(dir);
+		return -1;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	c->hash = cache_hash(data, st.st_size);
+	c->size = st.st_size;
+	c->mtime = st.st_mtime;
+
+	munmap(data, st.st_size);
+
+	if (asprintf(&(c->path), "%s/%016llx", dir,
+					(unsigned long long)c->hash) == -1) {
+		free(dir);
+		return -1;
+	}
+
+	free(dir);
+
+	cache_map(c);
+
+	return 0;
+}
+
+
+/*
+ * Release the entry.
+ */
+void cache_close(struct cache *c)
+{
+	cache_unmap(c);
+
+	free(c->path);
+	c->path = NULL;
+}
+
+
+/*
+ * Load the cached totals and checkpoints into "p". Returns false on a miss.
+ */
+bool cache_get_progress(struct cache *c, struct progress *p)
+{
+	if (!c->header || !(c->header->flags & CACHE_PROGRESS) ||
+			c->header->checkpoints == 0 ||
+			c->header->checkpoints > PROGRESS_CHECKPOINTS)
+		return false;
+
+	free(p->checkpoints);
+
+	p->checkpoints = (struct checkpoint *)malloc(PROGRESS_CHECKPOINTS *
+						sizeof(struct checkpoint));
+
+	if (p->checkpoints == NULL)
+		bail("cache_get_progress");
+
+	memcpy(p->checkpoints, c->checkpoints, c->header->checkpoints *
+						sizeof(struct checkpoint));
+
+	p->count = c->header->checkpoints;
+	p->stride = c->header->stride;
+	p->lines = c->header->lines;
+	p->filament = c->header->filament;
+	p->elapsed = c->header->elapsed;
+	p->built = true;
+
+	return true;
+}
+
+
+/*
+ * Set "bounds" to the cached extends of a verge mode. Returns false on a miss.
+ */
+bool cache_get_extends(struct cache *c, struct extends *bounds,
+			size_t *lines, bool deposition, bool physical)
+{
+	const int64_t (*cached)[2];
+
+	if (!c->header || !(c->header->flags & (CACHE_EXTENDS <<
+					cache_mode(deposition, physical))))
+		return false;
+
+	cached = c->header->extends[cache_mode(deposition, physical)];
+
+	bounds->x.min = cached[0][0];
+	bounds->x.max = cached[0][1];
+	bounds->y.min = cached[1][0];
+	bounds->y.max = cached[1][1];
+	bounds->z.min = cached[2][0];
+	bounds->z.max = cached[2][1];
+	bounds->e.min = cached[3][0];
+	bounds->e.max = cached[3][1];
+
+	*lines = c->header->lines;
+
+	return true;
+}
+
+
+/*
+ * Store the progress totals and checkpoints in the entry.
+ */
+void cache_put_progress(struct cache *c, struct progress *p)
+{
+	struct cache_header header;
+
+	cache_header_init(c, &header);
+
+	header.flags |= CACHE_PROGRESS;
+	header.lines = p->lines;
+	header.filament = p->filament;
+	header.elapsed = p->elapsed;
+	header.stride = p->stride;
+	header.checkpoints = p->count;
+
+	cache_write(c, &header, p->checkpoints);
+}
+
+
+/*
+ * Store the extends of a verge mode in the entry.
+ */
+void cache_put_extends(struct cache *c, struct extends *bounds,
+			size_t lines, bool deposition, bool physical)
+{
+	struct cache_header header;
+	int64_t (*cached)[2];
+
+	cache_header_init(c, &header);
+
+	cached = header.extends[cache_mode(deposition, physical)];
+
+	cached[0][0] = bounds->x.min;
+	cached[0][1] = bounds->x.max;
+	cached[1][0] = bounds->y.min;
+	cached[1][1] = bounds->y.max;
+	cached[2][0] = bounds->z.min;
+	cached[2][1] = bounds->z.max;
+	cached[3][0] = bounds->e.min;
+	cached[3][1] = bounds->e.max;
+
+	header.flags |= CACHE_EXTENDS << cache_mode(deposition, physical);
+	header.lines = lines;
+
+	cache_write(c, &header, c->checkpoints);
+}
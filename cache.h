@@ -0,0 +1,74 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "progress.h"
+
+#define CACHE_MAGIC		"AGAC"
+#define CACHE_MAGIC_LEN		4
+#define CACHE_VERSION		4
+
+/* The progress totals and checkpoints are present */
+#define CACHE_PROGRESS		0x1
+/* The extends of verge mode n are present when (CACHE_EXTENDS << n) is set */
+#define CACHE_EXTENDS		0x2
+
+#define CACHE_MODES		4
+
+
+/*
+ * A cache entry starts with this header, followed by "checkpoints" progress
+ * checkpoints when CACHE_PROGRESS is set. Extends are indexed by [mode][axis]
+ * [min or max] where the mode is given by cache_mode().
+ */
+struct cache_header {
+	char magic[CACHE_MAGIC_LEN];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t reserved;
+
+	uint64_t hash;
+	uint64_t size;
+	int64_t mtime;
+
+	uint64_t lines;
+	int64_t filament;
+	double elapsed;
+	uint64_t stride;
+	uint64_t checkpoints;
+
+	int64_t extends[CACHE_MODES][4][2];
+};
+
+
+struct cache {
+	/* key of the gcode file */
+	uint64_t hash;
+	uint64_t size;
+	int64_t mtime;
+
+	char *path;
+
+	/* mapped entry or NULL on a miss */
+	char *map;
+	size_t length;
+	const struct cache_header *header;
+	const struct checkpoint *checkpoints;
+};
+
+
+int cache_open(struct cache *c, const char *filename);
+void cache_close(struct cache *c);
+
+bool cache_get_progress(struct cache *c, struct progress *p);
+bool cache_get_extends(struct cache *c, struct extends *bounds,
+			size_t *lines, bool deposition, bool physical);
+
+void cache_put_progress(struct cache *c, struct progress *p);
+void cache_put_extends(struct cache *c, struct extends *bounds,
+			size_t lines, bool deposition, bool physical);
+
+#endif
@@ -1,11 +1,14 @@
 #define _POSIX_C_SOURCE /* fmemopen */
-#define _GNU_SOURCE /* fmemopen */
+#define _GNU_SOURCE /* fmemopen, madvise */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
-#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "gvm.h"
@@ -22,46 +25,65 @@ static void gcerr(const char *msg)
 
 
 /*
- * Read a decimal from "string" and return as a long int with 1000 times
- * greater magnitude.
+ * Read a decimal from the "length" bytes at "string" and return as a long int
+ * with 1000 times greater magnitude. Digits beyond the third decimal place are
+ * truncated. Returns LONG_MIN or LONG_MAX if the value does not fit.
  */
-static long int strtoml(char *string)
+static long int strtoml(const char *string, size_t length)
 {
-	long int head;
-	long int tail;
+	const char *end = string + length;
+	bool negative = false;
 
-	char *cursor;
+	long int head = 0;
+	long int tail = 0;
+	int places = 0;
 
-	head = strtol(string, &cursor, 10);
-
-	if (head == LONG_MIN || head == LONG_MAX)
-		return head;
+	if (string < end && *string == '-') {
+		negative = true;
+		string++;
+	}
 
-	if (cursor == string)
-		return head;
+	for (; string < end && *string >= '0' && *string <= '9'; string++) {
+		if (head > (LONG_MAX / 1000 - 9) / 10)
+			return negative ? LONG_MIN : LONG_MAX;
 
-	if (strlen(cursor) < 2)
-		return head * 1000;
+		head = (head * 10) + (*string - '0');
+	}
 
-	assert(cursor[0] == '.');
+	if (string < end && *string == '.') {
+		for (string++; string < end && *string >= '0' &&
+						*string <= '9'; string++) {
+			if (places < 3) {
+				tail = (tail * 10) + (*string - '0');
+				places++;
+			}
+		}
+	}
 
-	if (strlen(cursor) > 4)
-		cursor[4] = '\0';
+	for (; places < 3; places++)
+		tail *= 10;
 
-	tail = strtol(cursor + 1, &cursor, 10);
-	assert(tail < 1000);
+	head = (head * 1000) + tail;
 
-	if (tail == LONG_MIN || tail == LONG_MAX)
-		return tail;
+	return negative ? -head : head;
+}
 
-	if (cursor == string)
-		return head;
 
-	while (tail != 0 && tail < 100)
-		tail *= 10;
+/*
+ * Return true if "c" is whitespace that may separate words within a line.
+ */
+static bool isblank_gcode(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
 
 
-	return (head * 1000) + tail;
+/*
+ * Return true if "c" may appear in the value of a word.
+ */
+static bool isvalue_gcode(char c)
+{
+	return (c >= '0' && c <= '9') || c == '.' || c == '-';
 }
 
 
@@ -137,8 +159,14 @@ void gvm_init(struct gvm *m, bool verbose)
 	m->verbose = verbose;
 	m->sloppy = true;
 	m->unlocated_moves = true;
+	m->mapped = true;
 
 	m->gcode = NULL;
+	m->map = NULL;
+	m->length = 0;
+	m->cursor = 0;
+	m->end = 0;
+	m->records = NULL;
 	m->counter = 0;
 
 	m->mode = MODE_NONE;
@@ -148,6 +176,81 @@ void gvm_init(struct gvm *m, bool verbose)
 	point_clear(&(m->previous), NULL);
 	point_clear(&(m->offset), NULL);
 	point_clear(&(m->prevoffset), NULL);
+
+	m->feedrate = 0;
+	m->temperature[HEATER_HOTEND] = 0;
+	m->temperature[HEATER_BED] = 0;
+	m->fan = 0;
+	m->dwell = 0;
+	m->waits = 0;
+}
+
+
+/*
+ * Use the mapped file as compiled gcode records.
+ */
+static void gvm_map_records(struct gvm *m)
+{
+	const struct record_header *header;
+
+	header = (const struct record_header *)m->map;
+
+	if (m->length < sizeof(struct record_header) ||
+			header->version != RECORD_VERSION ||
+			header->size != sizeof(struct record) ||
+			header->count != (m->length -
+				sizeof(struct record_header)) /
+						sizeof(struct record))
+		gcerr("invalid compiled gcode");
+
+	m->records = (const struct record *)(m->map +
+					sizeof(struct record_header));
+	m->cursor = 0;
+	m->end = header->count;
+}
+
+
+/*
+ * Map regular file "path" into memory for the mapped reader. Returns -1 if the
+ * file cannot be mapped, in which case the caller should fall back to stdio.
+ */
+static int gvm_map(struct gvm *m, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+		bail("gvm_load");
+
+	if (fstat(fd, &st) == -1)
+		bail("gvm_load");
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	m->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (m->map == MAP_FAILED) {
+		m->map = NULL;
+		return -1;
+	}
+
+	madvise(m->map, st.st_size, MADV_SEQUENTIAL);
+
+	m->length = st.st_size;
+	m->cursor = 0;
+	m->end = m->length;
+
+	if (m->length >= RECORD_MAGIC_LEN &&
+			memcmp(m->map, RECORD_MAGIC, RECORD_MAGIC_LEN) == 0)
+		gvm_map_records(m);
+
+	return 0;
 }
 
 
@@ -156,12 +259,15 @@ void gvm_init(struct gvm *m, bool verbose)
  */
 void gvm_load(struct gvm *m, const char *path)
 {
-	if (m->gcode)
+	if (m->gcode || m->map)
 		bail("gcode file already open");
 
 	if (m->verbose)
 		fprintf(stderr, "gvm [load]: %s\n", path);
 
+	if (m->mapped && gvm_map(m, path) == 0)
+		return;
+
 	m->gcode = fopen(path, "r");
 
 	if (m->gcode == NULL)
@@ -169,11 +275,39 @@ void gvm_load(struct gvm *m, const char *path)
 }
 
 
+/*
+ * Read bytes [start, end) of the file mapped by "source", where "start" and
+ * "end" fall on line boundaries. The mapping must outlive the view.
+ */
+void gvm_view(struct gvm *m, struct gvm *source, size_t start, size_t end)
+{
+	if (m->gcode || m->map)
+		bail("gcode file already open");
+
+	if (!source->map || source->records)
+		bail("gvm_view");
+
+	m->map = source->map;
+	m->length = 0;
+	m->cursor = start;
+	m->end = end;
+}
+
+
 /*
  * Close open gcode file.
  */
 void gvm_close(struct gvm *m)
 {
+	if (m->map) {
+		if (m->length && munmap(m->map, m->length) != 0)
+			bail("gvm_close");
+
+		m->map = NULL;
+		m->records = NULL;
+		return;
+	}
+
 	if (fclose(m->gcode) != 0)
 		bail("gvm_close");
 
@@ -182,17 +316,201 @@ void gvm_close(struct gvm *m)
 
 
 /*
- * Decode next line into "cmd" and "result" and set "mask" to denote the axes
- * present in the line.
+ * Return true once the last line of the open file has been read.
  */
-int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
-							enum axismask *mask)
+bool gvm_eof(struct gvm *m)
+{
+	if (m->map)
+		return m->cursor > m->end;
+
+	return feof(m->gcode) != 0;
+}
+
+
+/*
+ * Decode the next line of a mapped file in place. Behaves as gvm_read_stream()
+ * but treats each line independently.
+ */
+static int gvm_read_mapped(struct gvm *m, struct command *cmd,
+				struct point *result, enum axismask *mask)
+{
+	const char *cursor;
+	const char *end;
+	const char *value;
+	char axis;
+	long int *target;
+
+	*mask = AXIS_NONE;
+	cmd->params = PARAM_NONE;
+
+	/* Step past the end as getc() would so that gvm_eof() is set */
+	if (m->cursor >= m->end) {
+		m->cursor = m->end + 1;
+		return -1;
+	}
+
+	cursor = m->map + m->cursor;
+	end = memchr(cursor, '\n', m->end - m->cursor);
+
+	if (end == NULL) {
+		end = m->map + m->end;
+		m->cursor = m->end + 1;
+	} else {
+		m->cursor = end - m->map + 1;
+	}
+
+	cmd->prefix = *cursor++;
+
+	if (cmd->prefix == '\n' || cmd->prefix == ';' || cmd->prefix == '#')
+		return -1;
+
+	while (cursor < end && isblank_gcode(*cursor))
+		cursor++;
+
+	if (cursor == end || *cursor < '0' || *cursor > '9') {
+		if (!m->sloppy)
+			gcerr("invalid command");
+
+		return -1;
+	}
+
+	for (cmd->code = 0; cursor < end && *cursor >= '0' && *cursor <= '9';
+								cursor++)
+		cmd->code = (cmd->code * 10) + (*cursor - '0');
+
+	if (m->verbose)
+		fprintf(stderr, "gvm  [cmd]: %c%d\n", cmd->prefix, cmd->code);
+
+	while (1) {
+		while (cursor < end && isblank_gcode(*cursor))
+			cursor++;
+
+		if (cursor == end)
+			return 0;
+
+		axis = *cursor++;
+
+		if (axis == ';' || axis == '#')
+			return 0;
+
+		for (value = cursor; cursor < end && isvalue_gcode(*cursor);
+								cursor++);
+
+		if (cursor == value) {
+			if (m->verbose) {
+				fprintf(stderr, "gvm [warn]: discarding "
+						"remainder of line\n");
+			}
+
+			return 0;
+		}
+
+		if (m->verbose) {
+			fprintf(stderr, "gvm [axis]: %c%.*s\n", axis,
+						(int)(cursor - value), value);
+		}
+
+		switch (axis) {
+		case 'X':
+			target = &(result->x);
+			*mask |= AXIS_X;
+			break;
+
+		case 'Y':
+			target = &(result->y);
+			*mask |= AXIS_Y;
+			break;
+
+		case 'Z':
+			target = &(result->z);
+			*mask |= AXIS_Z;
+			break;
+
+		case 'E':
+			target = &(result->e);
+			*mask |= AXIS_E;
+			break;
+
+		case 'F':
+			target = &(cmd->f);
+			cmd->params |= PARAM_F;
+			break;
+
+		case 'S':
+			target = &(cmd->s);
+			cmd->params |= PARAM_S;
+			break;
+
+		case 'P':
+			target = &(cmd->p);
+			cmd->params |= PARAM_P;
+			break;
+
+		default:
+			continue;
+		}
+
+		*target = strtoml(value, cursor - value);
+
+		if (*target == LONG_MIN || *target == LONG_MAX)
+			gcerr("invalid value");
+	}
+}
+
+
+/*
+ * Decode the next compiled record.
+ */
+static int gvm_read_compiled(struct gvm *m, struct command *cmd,
+				struct point *result, enum axismask *mask)
+{
+	const struct record *r;
+
+	if (m->cursor >= m->end) {
+		m->cursor = m->end + 1;
+		return -1;
+	}
+
+	r = &(m->records[m->cursor++]);
+
+	if (r->flags & RECORD_EOF)
+		m->cursor = m->end + 1;
+
+	cmd->prefix = r->prefix;
+	cmd->code = r->code;
+	cmd->params = r->params;
+	cmd->f = r->f;
+	cmd->s = r->s;
+	cmd->p = r->p;
+
+	*mask = r->mask;
+	result->x = r->x;
+	result->y = r->y;
+	result->z = r->z;
+	result->e = r->e;
+
+	if (!(r->flags & RECORD_VALID))
+		return -1;
+
+	if (m->verbose)
+		fprintf(stderr, "gvm  [cmd]: %c%d\n", cmd->prefix, cmd->code);
+
+	return 0;
+}
+
+
+/*
+ * Decode the next line of a stdio stream.
+ */
+static int gvm_read_stream(struct gvm *m, struct command *cmd,
+				struct point *result, enum axismask *mask)
 {
 	int n;
 	char axis;
 	char value[128];
 
 	*mask = AXIS_NONE;
+	cmd->params = PARAM_NONE;
 
 	n = fscanf(m->gcode, "%c%u", &(cmd->prefix), &(cmd->code));
 
@@ -220,7 +538,7 @@ int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 
 		switch (axis) {
 		case 'X':
-			result->x = strtoml(value);
+			result->x = strtoml(value, strlen(value));
 			*mask |= AXIS_X;
 
 			if (result->x == LONG_MIN || result->x == LONG_MAX)
@@ -229,7 +547,7 @@ int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 			break;
 
 		case 'Y':
-			result->y = strtoml(value);
+			result->y = strtoml(value, strlen(value));
 			*mask |= AXIS_Y;
 
 			if (result->y == LONG_MIN || result->y == LONG_MAX)
@@ -238,7 +556,7 @@ int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 			break;
 
 		case 'Z':
-			result->z = strtoml(value);
+			result->z = strtoml(value, strlen(value));
 			*mask |= AXIS_Z;
 
 			if (result->z == LONG_MIN || result->z == LONG_MAX)
@@ -247,7 +565,7 @@ int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 			break;
 
 		case 'E':
-			result->e = strtoml(value);
+			result->e = strtoml(value, strlen(value));
 			*mask |= AXIS_E;
 
 			if (result->e == LONG_MIN || result->e == LONG_MAX)
@@ -255,6 +573,33 @@ int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 
 			break;
 
+		case 'F':
+			cmd->f = strtoml(value, strlen(value));
+			cmd->params |= PARAM_F;
+
+			if (cmd->f == LONG_MIN || cmd->f == LONG_MAX)
+				gcerr("invalid value");
+
+			break;
+
+		case 'S':
+			cmd->s = strtoml(value, strlen(value));
+			cmd->params |= PARAM_S;
+
+			if (cmd->s == LONG_MIN || cmd->s == LONG_MAX)
+				gcerr("invalid value");
+
+			break;
+
+		case 'P':
+			cmd->p = strtoml(value, strlen(value));
+			cmd->params |= PARAM_P;
+
+			if (cmd->p == LONG_MIN || cmd->p == LONG_MAX)
+				gcerr("invalid value");
+
+			break;
+
 		default:
 			break;
 		}
@@ -279,6 +624,23 @@ int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 }
 
 
+/*
+ * Decode next line into "cmd" and "result" and set "mask" to denote the axes
+ * present in the line.
+ */
+int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
+							enum axismask *mask)
+{
+	if (m->records)
+		return gvm_read_compiled(m, cmd, result, mask);
+
+	if (m->map)
+		return gvm_read_mapped(m, cmd, result, mask);
+
+	return gvm_read_stream(m, cmd, result, mask);
+}
+
+
 /*
  * Apply a command to the virtual machine.:
  */
@@ -306,6 +668,17 @@ void gvm_apply(struct gvm *m, struct command *cmd, struct point *values,
 			default:
 				gcerr("mode undeclared");
 			}
+
+			if (cmd->params & PARAM_F)
+				m->feedrate = cmd->f;
+			break;
+
+		case 4:
+			/* G4 Dwell, P in milliseconds or S in seconds */
+			if (cmd->params & PARAM_P)
+				m->dwell = cmd->p / 1000;
+			else if (cmd->params & PARAM_S)
+				m->dwell = cmd->s;
 			break;
 
 		case 28:
@@ -336,6 +709,42 @@ void gvm_apply(struct gvm *m, struct command *cmd, struct point *values,
 		}
 		break;
 
+	case 'M':
+		switch (cmd->code) {
+		case 109:
+			/* M109 Set hotend temperature and wait */
+			m->waits |= 1 << HEATER_HOTEND;
+			/* fall through */
+
+		case 104:
+			/* M104 Set hotend temperature */
+			if (cmd->params & PARAM_S)
+				m->temperature[HEATER_HOTEND] = cmd->s;
+			break;
+
+		case 106:
+			/* M106 Fan on, full speed unless S is given */
+			m->fan = (cmd->params & PARAM_S) ? cmd->s : 255000;
+			break;
+
+		case 107:
+			/* M107 Fan off */
+			m->fan = 0;
+			break;
+
+		case 190:
+			/* M190 Set bed temperature and wait */
+			m->waits |= 1 << HEATER_BED;
+			/* fall through */
+
+		case 140:
+			/* M140 Set bed temperature */
+			if (cmd->params & PARAM_S)
+				m->temperature[HEATER_BED] = cmd->s;
+			break;
+		}
+		break;
+
 	case ';':
 	case '#':
 		/* comment */
@@ -345,15 +754,15 @@ void gvm_apply(struct gvm *m, struct command *cmd, struct point *values,
 
 
 /*
- * Step through the next line of gcode in the open file.
+ * Step through the next line of gcode setting "mask" to the axes present in
+ * the line if it was applied.
  */
-int gvm_step(struct gvm *m)
+static int gvm_step_mask(struct gvm *m, enum axismask *mask)
 {
 	struct command cmd;
 	struct point values;
-	enum axismask mask;
 
-	if (!m->gcode) {
+	if (!m->gcode && !m->map) {
 		bail("no gcode file has been opened");
 		return -1;
 	}
@@ -362,15 +771,20 @@ int gvm_step(struct gvm *m)
 	m->previous = m->position;
 	m->prevoffset = m->offset;
 
-	if (gvm_read(m, &cmd, &values, &mask) == 0)
-		gvm_apply(m, &cmd, &values, &mask);
+	m->dwell = 0;
+	m->waits = 0;
+
+	if (gvm_read(m, &cmd, &values, mask) == 0)
+		gvm_apply(m, &cmd, &values, mask);
+	else
+		*mask = AXIS_NONE;
 
 	if (m->verbose) {
 		fprintf(stderr, "gvm [resu]: ");
 		point_print(stderr, &(m->position));
 	}
 
-	if (feof(m->gcode) != 0)
+	if (gvm_eof(m))
 		return -1;
 
 	m->counter++;
@@ -379,6 +793,122 @@ int gvm_step(struct gvm *m)
 }
 
 
+/*
+ * Step through the next line of gcode in the open file.
+ */
+int gvm_step(struct gvm *m)
+{
+	enum axismask mask;
+
+	return gvm_step_mask(m, &mask);
+}
+
+
+/*
+ * Allocate "b" to hold up to "capacity" lines.
+ */
+void gvm_batch_init(struct gvm_batch *b, size_t capacity)
+{
+	long int **axes[8];
+	int i;
+
+	axes[0] = &(b->x);
+	axes[1] = &(b->y);
+	axes[2] = &(b->z);
+	axes[3] = &(b->e);
+	axes[4] = &(b->dx);
+	axes[5] = &(b->dy);
+	axes[6] = &(b->dz);
+	axes[7] = &(b->de);
+
+	for (i = 0; i < 8; i++) {
+		*axes[i] = (long int *)malloc(capacity * sizeof(long int));
+
+		if (*axes[i] == NULL)
+			bail("gvm_batch_init");
+	}
+
+	b->mask = (unsigned char *)malloc(capacity);
+	b->flags = (unsigned char *)malloc(capacity);
+
+	if (b->mask == NULL || b->flags == NULL)
+		bail("gvm_batch_init");
+
+	b->capacity = capacity;
+	b->count = 0;
+}
+
+
+/*
+ * Release the buffers of "b".
+ */
+void gvm_batch_free(struct gvm_batch *b)
+{
+	free(b->x);
+	free(b->y);
+	free(b->z);
+	free(b->e);
+	free(b->dx);
+	free(b->dy);
+	free(b->dz);
+	free(b->de);
+	free(b->mask);
+	free(b->flags);
+
+	memset(b, 0, sizeof(struct gvm_batch));
+}
+
+
+/*
+ * Step through up to the capacity of "b" lines, storing the position and
+ * delta after each line as gvm_get_position() and gvm_get_delta() would
+ * return them. When "physical" is true lines stepped while the machine is
+ * located hold physical values and have BATCH_PHYSICAL set, other lines hold
+ * axis values. Returns the number of lines stepped, 0 at the end of the file.
+ */
+size_t gvm_step_batch(struct gvm *m, struct gvm_batch *b, bool physical)
+{
+	enum axismask mask;
+	size_t i;
+
+	for (i = 0; i < b->capacity; i++) {
+		if (gvm_step_mask(m, &mask) == -1)
+			break;
+
+		b->x[i] = m->position.x;
+		b->y[i] = m->position.y;
+		b->z[i] = m->position.z;
+		b->e[i] = m->position.e;
+
+		b->dx[i] = m->position.x - m->previous.x;
+		b->dy[i] = m->position.y - m->previous.y;
+		b->dz[i] = m->position.z - m->previous.z;
+		b->de[i] = m->position.e - m->previous.e;
+
+		b->mask[i] = mask & (AXIS_X | AXIS_Y | AXIS_Z | AXIS_E);
+		b->flags[i] = m->located ? BATCH_LOCATED : 0;
+
+		if (physical && m->located) {
+			b->x[i] -= m->offset.x;
+			b->y[i] -= m->offset.y;
+			b->z[i] -= m->offset.z;
+			b->e[i] -= m->offset.e;
+
+			b->dx[i] -= m->offset.x - m->prevoffset.x;
+			b->dy[i] -= m->offset.y - m->prevoffset.y;
+			b->dz[i] -= m->offset.z - m->prevoffset.z;
+			b->de[i] -= m->offset.e - m->prevoffset.e;
+
+			b->flags[i] |= BATCH_PHYSICAL;
+		}
+	}
+
+	b->count = i;
+
+	return i;
+}
+
+
 /*
  * Run entire gcode file.
  */
@@ -397,6 +927,62 @@ unsigned int gvm_get_counter(struct gvm *m)
 }
 
 
+/*
+ * Return the byte offset in the source file of the next line to be read.
+ */
+size_t gvm_get_offset(struct gvm *m)
+{
+	if (m->records) {
+		if (m->end == 0)
+			return 0;
+
+		if (m->cursor >= m->end)
+			return m->records[m->end - 1].offset;
+
+		return m->records[m->cursor].offset;
+	}
+
+	if (m->map)
+		return m->cursor > m->end ? m->end : m->cursor;
+
+	return ftell(m->gcode);
+}
+
+
+/*
+ * Return the position of the reader for gvm_seek().
+ */
+size_t gvm_tell(struct gvm *m)
+{
+	long int position;
+
+	if (m->map)
+		return m->cursor;
+
+	position = ftell(m->gcode);
+
+	if (position == -1)
+		bail("gvm_tell");
+
+	return (size_t)position;
+}
+
+
+/*
+ * Move the reader to "position" from gvm_tell(), where "counter" lines had
+ * been stepped. The caller restores any other state.
+ */
+void gvm_seek(struct gvm *m, size_t position, unsigned int counter)
+{
+	if (m->map)
+		m->cursor = position;
+	else if (fseek(m->gcode, (long int)position, SEEK_SET) != 0)
+		bail("gvm_seek");
+
+	m->counter = counter;
+}
+
+
 /*
  * Set "result" to values of current axis positions.
  * If "physical" is true then use values of real axis positions relative to the
@@ -1,6 +1,10 @@
+#ifndef H_GVM
+#define H_GVM
+
 #include <stdbool.h>
 
 #include "point.h"
+#include "record.h"
 
 
 enum coordmode {
@@ -10,9 +14,33 @@ enum coordmode {
 };
 
 
+enum parammask {
+	PARAM_NONE = 0,
+	PARAM_F = 1,
+	PARAM_S = 2,
+	PARAM_P = 4
+};
+
+
+enum heater {
+	HEATER_HOTEND,
+	HEATER_BED,
+	HEATERS
+};
+
+
+/*
+ * Feedrate is in units of micro meters per minute. S and P are fixed-point
+ * thousandths of the value given.
+ */
 struct command {
 	char prefix;
 	unsigned int code;
+
+	enum parammask params;
+	long int f;
+	long int s;
+	long int p;
 };
 
 
@@ -21,9 +49,15 @@ struct gvm {
 	bool verbose;
 	bool sloppy;
 	bool unlocated_moves;
+	bool mapped;
 
 	/* state */
 	FILE *gcode;
+	char *map;
+	size_t length;	/* bytes mapped by this gvm, 0 for views */
+	size_t cursor;
+	size_t end;
+	const struct record *records;
 	unsigned int counter;
 
 	enum coordmode mode;
@@ -33,12 +67,56 @@ struct gvm {
 	struct point previous;
 	struct point offset;
 	struct point prevoffset;
+
+	/* feedrate in micro meters per minute, 0 until set */
+	long int feedrate;
+
+	/* heater targets in thousandths of a degree */
+	long int temperature[HEATERS];
+
+	/* fan speed from 0 to 255 in thousandths */
+	long int fan;
+
+	/* milliseconds the last step dwelt for and heaters it waited for */
+	long int dwell;
+	unsigned int waits;
+};
+
+
+/* The machine was located after the line */
+#define BATCH_LOCATED		0x1
+/* Position and delta of the line are physical values */
+#define BATCH_PHYSICAL		0x2
+
+
+/*
+ * Positions, deltas and axis masks of consecutive lines stored as one array
+ * per field so reductions over them run as tight loops.
+ */
+struct gvm_batch {
+	size_t capacity;
+	size_t count;
+
+	long int *x;
+	long int *y;
+	long int *z;
+	long int *e;
+
+	long int *dx;
+	long int *dy;
+	long int *dz;
+	long int *de;
+
+	unsigned char *mask;
+	unsigned char *flags;
 };
 
 
 void gvm_init(struct gvm *m, bool verbose);
 void gvm_load(struct gvm *m, const char *path);
+void gvm_view(struct gvm *m, struct gvm *source, size_t start, size_t end);
 void gvm_close(struct gvm *m);
+bool gvm_eof(struct gvm *m);
 
 int gvm_read(struct gvm *m, struct command *cmd, struct point *result,
 							enum axismask *mask);
@@ -49,6 +127,15 @@ void gvm_apply(struct gvm *m, struct command *cmd, struct point *values,
 int gvm_step(struct gvm *m);
 void gvm_run(struct gvm *m);
 
+void gvm_batch_init(struct gvm_batch *b, size_t capacity);
+void gvm_batch_free(struct gvm_batch *b);
+size_t gvm_step_batch(struct gvm *m, struct gvm_batch *b, bool physical);
+
 unsigned int gvm_get_counter(struct gvm *m);
+size_t gvm_get_offset(struct gvm *m);
+size_t gvm_tell(struct gvm *m);
+void gvm_seek(struct gvm *m, size_t position, unsigned int counter);
 int gvm_get_position(struct gvm *m, struct point *result, bool physical);
 int gvm_get_delta(struct gvm *m, struct point *result, bool physical);
+
+#endif
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE /* ftruncate */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+
+
+/*
+ * Return the check value of "e".
+ */
+static uint64_t journal_check(const struct journal_entry *e)
+{
+	return (e->sequence ^ e->line ^ e->offset) * 0x9e3779b97f4a7c15ULL;
+}
+
+
+/*
+ * Start a new journal at "path", replacing any journal already there, and map
+ * it into memory. Returns false on error.
+ */
+bool journal_open(struct journal *j, const char *path)
+{
+	int fd;
+	void *map;
+
+	memset(j, 0, sizeof(struct journal));
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd == -1)
+		return false;
+
+	if (ftruncate(fd, sizeof(struct journal_file)) == -1) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, sizeof(struct journal_file), PROT_READ | PROT_WRITE,
+							MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	j->map = map;
+	memcpy(j->map->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+	j->map->version = JOURNAL_VERSION;
+	j->map->size = sizeof(struct journal_file);
+	j->dirty = true;
+
+	return true;
+}
+
+
+/*
+ * Record "line" starting at "offset" as the last acknowledged. This only
+ * writes to memory, it reaches the disk on the next journal_sync().
+ */
+void journal_ack(struct journal *j, uint64_t line, uint64_t offset)
+{
+	struct journal_entry *e;
+
+	if (j->map == NULL)
+		return;
+
+	j->sequence++;
+	e = &(j->map->entries[j->sequence & 1]);
+
+	e->sequence = j->sequence;
+	e->line = line;
+	e->offset = offset;
+	e->check = journal_check(e);
+
+	j->dirty = true;
+}
+
+
+/*
+ * Start writing the journal back to disk if it has changed and was last
+ * written at least JOURNAL_SYNC milliseconds before "now".
+ */
+void journal_sync(struct journal *j, long int now)
+{
+	if (j->map == NULL || !j->dirty || now - j->synced < JOURNAL_SYNC)
+		return;
+
+	msync(j->map, sizeof(struct journal_file), MS_ASYNC);
+
+	j->synced = now;
+	j->dirty = false;
+}
+
+
+/*
+ * Write the journal to disk and unmap it.
+ */
+void journal_close(struct journal *j)
+{
+	if (j->map == NULL)
+		return;
+
+	msync(j->map, sizeof(struct journal_file), MS_SYNC);
+	munmap(j->map, sizeof(struct journal_file));
+
+	j->map = NULL;
+}
+
+
+/*
+ * Read the last acknowledged line and its offset from the journal at "path".
+ * Returns false if there is no valid entry.
+ */
+bool journal_read(const char *path, uint64_t *line, uint64_t *offset)
+{
+	struct journal_file file;
+	const struct journal_entry *e;
+	const struct journal_entry *latest = NULL;
+	FILE *stream;
+	int i;
+
+	stream = fopen(path, "r");
+
+	if (stream == NULL)
+		return false;
+
+	if (fread(&file, sizeof(struct journal_file), 1, stream) != 1 ||
+		memcmp(file.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0 ||
+		file.version != JOURNAL_VERSION ||
+		file.size != sizeof(struct journal_file)) {
+		fclose(stream);
+		return false;
+	}
+
+	fclose(stream);
+
+	for (i = 0; i < 2; i++) {
+		e = &(file.entries[i]);
+
+		if (e->sequence == 0 || e->check != journal_check(e))
+			continue;
+
+		if (latest == NULL || e->sequence > latest->sequence)
+			latest = e;
+	}
+
+	if (latest == NULL)
+		return false;
+
+	*line = latest->line;
+	*offset = latest->offset;
+
+	return true;
+}
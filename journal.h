@@ -0,0 +1,62 @@
+#ifndef H_JOURNAL
+#define H_JOURNAL
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC		"AGJN"
+#define JOURNAL_MAGIC_LEN	4
+#define JOURNAL_VERSION		1
+
+/* Milliseconds between writing the journal back to disk while it changes */
+#define JOURNAL_SYNC		1000
+
+
+/*
+ * The last acknowledged line of the source, 1-based, and the byte offset it
+ * starts at. "check" is derived from the other fields so a partly written
+ * entry is recognised.
+ */
+struct journal_entry {
+	uint64_t sequence;
+	uint64_t line;
+	uint64_t offset;
+	uint64_t check;
+};
+
+
+/*
+ * Journal file, in native byte order. Entries are written alternately so the
+ * one not being written is intact, and the valid entry with the highest
+ * sequence is the latest.
+ */
+struct journal_file {
+	char magic[JOURNAL_MAGIC_LEN];
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+
+	struct journal_entry entries[2];
+};
+
+
+/*
+ * Journal mapped into memory, with when it was last written back and whether
+ * it has changed since.
+ */
+struct journal {
+	struct journal_file *map;
+	uint64_t sequence;
+	long int synced;
+	bool dirty;
+};
+
+
+bool journal_open(struct journal *j, const char *path);
+void journal_ack(struct journal *j, uint64_t line, uint64_t offset);
+void journal_sync(struct journal *j, long int now);
+void journal_close(struct journal *j);
+
+bool journal_read(const char *path, uint64_t *line, uint64_t *offset);
+
+#endif
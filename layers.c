@@ -0,0 +1,358 @@
+#define _GNU_SOURCE /* asprintf */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "point.h"
+#include "gvm.h"
+#include "motion.h"
+#include "layers.h"
+
+#define MIN(p, q) (((p) < (q)) ? (p) : (q))
+#define MAX(p, q) (((p) >= (q)) ? (p) : (q))
+
+
+/*
+ * Layers found by one way of detecting them.
+ */
+struct layers_build {
+	struct layer *layers;
+	size_t count;
+	size_t capacity;
+};
+
+
+/*
+ * Totals at the start of a line, where a layer may begin.
+ */
+struct layers_mark {
+	uint64_t offset;
+	uint32_t line;
+	int64_t filament;
+	double elapsed;
+};
+
+
+/*
+ * Return true if the mapped line at "offset" is a slicer layer comment.
+ */
+static bool layers_comment(struct gvm *m, size_t offset)
+{
+	static const char *markers[] = {";LAYER:", ";LAYER_CHANGE"};
+	size_t length;
+	int i;
+
+	/* Comments are only visible in mapped gcode text */
+	if (!m->map || m->records)
+		return false;
+
+	for (i = 0; i < 2; i++) {
+		length = strlen(markers[i]);
+
+		if (offset + length <= m->end &&
+				memcmp(m->map + offset, markers[i], length) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * End the last layer of "b" before the line at "mark".
+ */
+static void layers_close(struct layers_build *b, struct layers_mark *mark)
+{
+	struct layer *l;
+
+	if (b->count == 0)
+		return;
+
+	l = &(b->layers[b->count - 1]);
+
+	l->lines = mark->line - l->line;
+	l->filament = mark->filament;
+	l->duration = (uint32_t)(mark->elapsed * 1000.0) - l->elapsed;
+	l->elapsed = (uint32_t)(mark->elapsed * 1000.0);
+}
+
+
+/*
+ * End the last layer of "b" and start a new one at "mark" at height "z".
+ * Until it is closed the elapsed time of a layer holds its start time.
+ */
+static void layers_open(struct layers_build *b, struct layers_mark *mark,
+								long int z)
+{
+	struct layer *l;
+
+	layers_close(b, mark);
+
+	if (b->count >= b->capacity) {
+		b->capacity = b->capacity ? b->capacity * 2 : 64;
+		b->layers = realloc(b->layers, b->capacity *
+							sizeof(struct layer));
+
+		if (b->layers == NULL)
+			bail("layers_open");
+	}
+
+	l = &(b->layers[b->count++]);
+	memset(l, 0, sizeof(struct layer));
+
+	l->offset = mark->offset;
+	l->line = mark->line;
+	l->elapsed = (uint32_t)(mark->elapsed * 1000.0);
+	l->z = (int32_t)z;
+
+	l->bounds[0][0] = INT32_MAX;
+	l->bounds[0][1] = INT32_MIN;
+	l->bounds[1][0] = INT32_MAX;
+	l->bounds[1][1] = INT32_MIN;
+}
+
+
+/*
+ * Extend the bounds of the last layer of "b" to a deposition move. Layers
+ * take the height they first deposit at.
+ */
+static void layers_deposit(struct layers_build *b, struct point *pos,
+							struct point *delta)
+{
+	int32_t (*bounds)[2];
+
+	if (b->count == 0)
+		return;
+
+	bounds = b->layers[b->count - 1].bounds;
+
+	if (bounds[0][0] > bounds[0][1])
+		b->layers[b->count - 1].z = (int32_t)pos->z;
+
+	bounds[0][0] = MIN(bounds[0][0], pos->x);
+	bounds[0][1] = MAX(bounds[0][1], pos->x);
+	bounds[0][0] = MIN(bounds[0][0], pos->x - delta->x);
+	bounds[0][1] = MAX(bounds[0][1], pos->x - delta->x);
+
+	bounds[1][0] = MIN(bounds[1][0], pos->y);
+	bounds[1][1] = MAX(bounds[1][1], pos->y);
+	bounds[1][0] = MIN(bounds[1][0], pos->y - delta->y);
+	bounds[1][1] = MAX(bounds[1][1], pos->y - delta->y);
+}
+
+
+/*
+ * Index the layers of gcode file "filename" in a single pass, setting
+ * "layers" to an array of them and returning the count. Layers start at
+ * slicer layer comments when the file has any. Otherwise a layer starts at
+ * the line that moved Z to the height of the next deposition move made at a
+ * new height, so that Z hops do not start layers. Lines before the first
+ * layer are not part of any layer.
+ */
+size_t layers_index(struct layer **layers, const char *filename)
+{
+	struct layers_build comments;
+	struct layers_build heights;
+	struct layers_build *found;
+
+	struct gvm m;
+	struct motion mo;
+	struct point pos;
+	struct point delta;
+	struct point extruded;
+
+	struct layers_mark mark;
+	struct layers_mark zmark;
+	bool deposit;
+
+	memset(&comments, 0, sizeof(struct layers_build));
+	memset(&heights, 0, sizeof(struct layers_build));
+	memset(&mark, 0, sizeof(struct layers_mark));
+
+	gvm_init(&m, false);
+	gvm_load(&m, filename);
+	motion_init(&mo);
+
+	mark.line = 1;
+	zmark = mark;
+
+	while (1) {
+		mark.offset = gvm_get_offset(&m);
+
+		if (layers_comment(&m, mark.offset))
+			layers_open(&comments, &mark, m.position.z);
+
+		if (gvm_step(&m) == -1)
+			break;
+
+		motion_step(&mo, &m);
+
+		gvm_get_position(&m, &pos, false);
+		gvm_get_delta(&m, &delta, false);
+
+		/* Filament is measured as for the progress table */
+		gvm_get_delta(&m, &extruded, true);
+
+		if (delta.z != 0)
+			zmark = mark;
+
+		deposit = delta.e > 0 && (delta.x != 0 || delta.y != 0);
+
+		if (deposit) {
+			if (heights.count == 0 ||
+				heights.layers[heights.count - 1].z != pos.z)
+				layers_open(&heights, &zmark, pos.z);
+
+			layers_deposit(&heights, &pos, &delta);
+			layers_deposit(&comments, &pos, &delta);
+		}
+
+		mark.line++;
+		mark.filament += extruded.e;
+		mark.elapsed = mo.elapsed;
+	}
+
+	gvm_close(&m);
+
+	found = comments.count ? &comments : &heights;
+	layers_close(found, &mark);
+
+	if (found == &comments)
+		free(heights.layers);
+	else
+		free(comments.layers);
+
+	*layers = found->layers;
+
+	return found->count;
+}
+
+
+/*
+ * Return the path of the layer index kept next to gcode file "filename".
+ */
+char *layers_path(const char *filename)
+{
+	char *path;
+
+	if (asprintf(&path, "%s%s", filename, LAYERS_SUFFIX) == -1)
+		bail("layers_path");
+
+	return path;
+}
+
+
+/*
+ * Write "count" layers of gcode file "filename" to the index at "path".
+ */
+void layers_write(const char *path, const char *filename,
+				const struct layer *layers, size_t count)
+{
+	struct layers_header header;
+	struct stat st;
+	FILE *stream;
+
+	if (stat(filename, &st) == -1)
+		bail("layers_write");
+
+	memset(&header, 0, sizeof(struct layers_header));
+	memcpy(header.magic, LAYERS_MAGIC, LAYERS_MAGIC_LEN);
+	header.version = LAYERS_VERSION;
+	header.size = sizeof(struct layer);
+	header.count = count;
+	header.source_size = st.st_size;
+	header.source_mtime = st.st_mtime;
+
+	stream = fopen(path, "w");
+
+	if (stream == NULL)
+		bail("layers_write");
+
+	if (fwrite(&header, sizeof(struct layers_header), 1, stream) != 1 ||
+		fwrite(layers, sizeof(struct layer), count, stream) != count)
+		bail("layers_write");
+
+	if (fclose(stream) != 0)
+		bail("layers_write");
+}
+
+
+/*
+ * Read the index at "path" of gcode file "filename". Returns NULL if there is
+ * no index or it does not match the file.
+ */
+struct layer *layers_read(const char *path, const char *filename,
+							size_t *count)
+{
+	struct layers_header header;
+	struct layer *layers;
+	struct stat st;
+	FILE *stream;
+
+	if (stat(filename, &st) == -1)
+		return NULL;
+
+	stream = fopen(path, "r");
+
+	if (stream == NULL)
+		return NULL;
+
+	if (fread(&header, sizeof(struct layers_header), 1, stream) != 1 ||
+			memcmp(header.magic, LAYERS_MAGIC,
+						LAYERS_MAGIC_LEN) != 0 ||
+			header.version != LAYERS_VERSION ||
+			header.size != sizeof(struct layer) ||
+			header.source_size != (uint64_t)st.st_size ||
+			header.source_mtime != (int64_t)st.st_mtime) {
+		fclose(stream);
+		return NULL;
+	}
+
+	layers = malloc((header.count ? header.count : 1) *
+							sizeof(struct layer));
+
+	if (layers == NULL)
+		bail("layers_read");
+
+	if (fread(layers, sizeof(struct layer), header.count, stream) !=
+								header.count) {
+		free(layers);
+		fclose(stream);
+		return NULL;
+	}
+
+	fclose(stream);
+
+	*count = header.count;
+
+	return layers;
+}
+
+
+/*
+ * Return the layer containing 1-based "line" or NULL if it is in no layer.
+ */
+const struct layer *layers_find(const struct layer *layers, size_t count,
+							unsigned int line)
+{
+	size_t low = 0;
+	size_t high = count;
+	size_t middle;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (line < layers[middle].line)
+			high = middle;
+		else if (line >= layers[middle].line + layers[middle].lines)
+			low = middle + 1;
+		else
+			return &(layers[middle]);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef H_LAYERS
+#define H_LAYERS
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LAYERS_MAGIC		"AGLI"
+#define LAYERS_MAGIC_LEN	4
+#define LAYERS_VERSION		1
+
+/* Suffix of the index written next to a gcode file */
+#define LAYERS_SUFFIX		".layers"
+
+
+/*
+ * A layer index starts with this header followed by "count" layers. Both are
+ * stored in native byte order. The index is only valid while the gcode file
+ * keeps the size and mtime recorded.
+ */
+struct layers_header {
+	char magic[LAYERS_MAGIC_LEN];
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+
+	uint64_t count;
+	uint64_t source_size;
+	int64_t source_mtime;
+};
+
+
+/*
+ * One layer of a print. "line" is the 1-based line the layer starts on and
+ * "offset" the byte offset of that line. Filament and elapsed time are totals
+ * from the start of the file up to the end of the layer, in micro meters and
+ * milliseconds. Bounds are the X and Y extents of material deposited in the
+ * layer, indexed by [axis][min or max], and are empty when min exceeds max.
+ */
+struct layer {
+	uint64_t offset;
+	uint32_t line;
+	uint32_t lines;
+
+	int64_t filament;
+	uint32_t elapsed;
+	uint32_t duration;
+
+	int32_t z;
+	int32_t bounds[2][2];
+	uint32_t reserved;
+};
+
+
+size_t layers_index(struct layer **layers, const char *filename);
+char *layers_path(const char *filename);
+void layers_write(const char *path, const char *filename,
+				const struct layer *layers, size_t count);
+struct layer *layers_read(const char *path, const char *filename,
+							size_t *count);
+const struct layer *layers_find(const struct layer *layers, size_t count,
+							unsigned int line);
+
+#endif
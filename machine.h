@@ -3,3 +3,16 @@
 #define MAX_Z		210
 
 #define OVER_LIMIT	10
+
+/* Acceleration of every axis in mm/s^2 */
+#define ACCELERATION	1000.0
+/* Speed in mm/s that moves start and end at */
+#define JERK		10.0
+/* Feedrate in mm/min used until the gcode sets one */
+#define FEEDRATE	3000.0
+
+/* Temperature in degrees that heaters start at */
+#define AMBIENT		20.0
+/* Heating and cooling rates in degrees per second */
+#define HOTEND_RATE	2.0
+#define BED_RATE	0.5
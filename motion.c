@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "point.h"
+#include "gvm.h"
+#include "machine.h"
+#include "motion.h"
+
+
+static const double heater_rate[HEATERS] = {
+	HOTEND_RATE,
+	BED_RATE
+};
+
+
+/*
+ * Return the time taken to move "distance" mm at up to "speed" mm/s with a
+ * trapezoidal velocity profile that starts and ends at the jerk speed.
+ */
+static double motion_trapezoid(double distance, double speed)
+{
+	double accel = ACCELERATION;
+	double junction = speed < JERK ? speed : JERK;
+	double ramp;
+	double peak;
+
+	if (distance <= 0.0 || speed <= 0.0)
+		return 0.0;
+
+	/* distance covered accelerating to full speed and back again */
+	ramp = (speed * speed - junction * junction) / accel;
+
+	if (distance >= ramp)
+		return 2.0 * (speed - junction) / accel +
+						(distance - ramp) / speed;
+
+	/* full speed is never reached */
+	peak = sqrt(accel * distance + junction * junction);
+
+	return 2.0 * (peak - junction) / accel;
+}
+
+
+/*
+ * Move the modelled heaters towards their targets for "seconds".
+ */
+static void motion_heat(struct motion *mo, struct gvm *m, double seconds)
+{
+	double target;
+	double change;
+	int i;
+
+	for (i = 0; i < HEATERS; i++) {
+		target = (double)m->temperature[i] / 1000.0;
+		change = heater_rate[i] * seconds;
+
+		if (fabs(target - mo->temperature[i]) <= change)
+			mo->temperature[i] = target;
+		else if (target > mo->temperature[i])
+			mo->temperature[i] += change;
+		else
+			mo->temperature[i] -= change;
+	}
+}
+
+
+/*
+ * Initialise the model to a cold machine at rest.
+ */
+void motion_init(struct motion *mo)
+{
+	int i;
+
+	mo->elapsed = 0.0;
+
+	for (i = 0; i < HEATERS; i++)
+		mo->temperature[i] = AMBIENT;
+}
+
+
+/*
+ * Return the time in seconds taken by the last step of "m" and add it to the
+ * elapsed time. Moves are measured between physical positions so that G92
+ * takes no time, and heater waits last until the modelled heater reaches its
+ * target.
+ */
+double motion_step(struct motion *mo, struct gvm *m)
+{
+	double dx, dy, dz, de;
+	double distance;
+	double speed;
+	double seconds;
+	double wait;
+	int i;
+
+	dx = (double)((m->position.x - m->offset.x) -
+				(m->previous.x - m->prevoffset.x)) / 1000.0;
+	dy = (double)((m->position.y - m->offset.y) -
+				(m->previous.y - m->prevoffset.y)) / 1000.0;
+	dz = (double)((m->position.z - m->offset.z) -
+				(m->previous.z - m->prevoffset.z)) / 1000.0;
+	de = (double)((m->position.e - m->offset.e) -
+				(m->previous.e - m->prevoffset.e)) / 1000.0;
+
+	distance = sqrt(dx * dx + dy * dy + dz * dz);
+
+	/* Extruder only moves such as retractions */
+	if (distance == 0.0)
+		distance = fabs(de);
+
+	if (m->feedrate > 0)
+		speed = (double)m->feedrate / 1000.0 / 60.0;
+	else
+		speed = FEEDRATE / 60.0;
+
+	seconds = motion_trapezoid(distance, speed);
+	seconds += (double)m->dwell / 1000.0;
+
+	motion_heat(mo, m, seconds);
+
+	/* Other heaters carry on towards their targets during a wait */
+	for (i = 0; i < HEATERS; i++) {
+		if (!(m->waits & (1 << i)))
+			continue;
+
+		wait = fabs((double)m->temperature[i] / 1000.0 -
+				mo->temperature[i]) / heater_rate[i];
+
+		motion_heat(mo, m, wait);
+		seconds += wait;
+	}
+
+	mo->elapsed += seconds;
+
+	return seconds;
+}
@@ -0,0 +1,19 @@
+#ifndef H_MOTION
+#define H_MOTION
+
+#include "gvm.h"
+
+
+/*
+ * Modelled state of the machine while estimating print time.
+ */
+struct motion {
+	double elapsed;
+	double temperature[HEATERS];
+};
+
+
+void motion_init(struct motion *mo);
+double motion_step(struct motion *mo, struct gvm *m);
+
+#endif
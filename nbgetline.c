@@ -1,42 +1,192 @@
 #define _GNU_SOURCE /* ssize_t */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/fcntl.h>
 
+#include "nbgetline.h"
+
+
+/*
+ * Initialise "lb" to empty.
+ */
+void linebuf_init(struct linebuf *lb)
+{
+	lb->start = 0;
+	lb->end = 0;
+	lb->eof = false;
+}
+
 
 /*
- * Read a complete line from stream if available otherwise leave all bytes on
- * the stream.
+ * Return the number of unconsumed bytes in "lb".
  */
-ssize_t nonblock_getline(char *lineptr, FILE *stream)
+size_t linebuf_length(const struct linebuf *lb)
 {
-	ssize_t n = 0;
-	ssize_t i = 0;
-	int c;
+	return lb->end - lb->start;
+}
 
-	/*
-	 * Read bytes off the stream until we reach the end of a line or EOF.
-	 */
-	do {
-		c = fgetc(stream);
-		if (c != EOF) {
-			lineptr[n] = c;
-			n++;
-		}
-	} while (c != '\n' && c != EOF);
 
-	lineptr[n] = '\0';
+/*
+ * Return the number of bytes that can be added to "lb".
+ */
+size_t linebuf_space(const struct linebuf *lb)
+{
+	return LINEBUF_LEN - linebuf_length(lb);
+}
+
+
+/*
+ * Move the unconsumed bytes of "lb" to the start of the buffer.
+ */
+static void linebuf_compact(struct linebuf *lb)
+{
+	if (lb->start == 0)
+		return;
+
+	memmove(lb->data, lb->data + lb->start, linebuf_length(lb));
+	lb->end -= lb->start;
+	lb->start = 0;
+}
 
-	/*
-	 * If we do not have a complete line then push all the read characters
-	 * back into the stream.
-	 */
-	if (c == EOF) {
-		for (i = n - 1; i >= 0; i--)
-			ungetc(lineptr[i], stream);
 
+/*
+ * Read what is available from non-blocking "fd" into "lb". Returns the number
+ * of bytes read, 0 at end of file or -1 on error, including when nothing is
+ * available (EAGAIN) or there is no space (ENOBUFS).
+ */
+ssize_t linebuf_fill(struct linebuf *lb, int fd)
+{
+	ssize_t n;
+
+	linebuf_compact(lb);
+
+	if (lb->end >= LINEBUF_LEN) {
+		errno = ENOBUFS;
 		return -1;
 	}
 
+	n = read(fd, lb->data + lb->end, LINEBUF_LEN - lb->end);
+
+	if (n == 0)
+		lb->eof = true;
+	else if (n > 0)
+		lb->end += n;
+
+	return n;
+}
+
+
+/*
+ * Copy the next complete line of "lb", including its newline, to "line" of
+ * "size" bytes and null terminate it. A buffer full without a newline, or
+ * what is left at end of file, is returned as a line. Longer lines are
+ * truncated to fit "line". Returns the length of the line or 0 if there is
+ * no complete line yet.
+ */
+ssize_t linebuf_getline(struct linebuf *lb, char *line, size_t size)
+{
+	const char *found;
+	size_t length;
+	size_t copy;
+
+	found = memchr(lb->data + lb->start, '\n', linebuf_length(lb));
+
+	if (found)
+		length = (found - (lb->data + lb->start)) + 1;
+	else if (linebuf_space(lb) == 0 || (lb->eof && linebuf_length(lb)))
+		length = linebuf_length(lb);
+	else
+		return 0;
+
+	copy = length < size ? length : size - 1;
+
+	memcpy(line, lb->data + lb->start, copy);
+	line[copy] = '\0';
+
+	lb->start += length;
+
+	return copy;
+}
+
+
+/*
+ * Return the next complete line of "lb" in place, without its line ending and
+ * null terminated, and set "length" to its length. Lines are found as by
+ * linebuf_getline(). The line is valid until "lb" is next filled. Returns NULL
+ * if there is no complete line yet.
+ */
+char *linebuf_next(struct linebuf *lb, size_t *length)
+{
+	char *line = lb->data + lb->start;
+	char *found;
+
+	found = memchr(line, '\n', linebuf_length(lb));
+
+	if (found) {
+		*length = found - line;
+		lb->start += *length + 1;
+	} else if (linebuf_space(lb) == 0 || (lb->eof && linebuf_length(lb))) {
+		*length = linebuf_length(lb);
+		lb->start = lb->end;
+	} else {
+		return NULL;
+	}
+
+	if (*length > 0 && line[*length - 1] == '\r')
+		(*length)--;
+
+	line[*length] = '\0';
+
+	return line;
+}
+
+
+/*
+ * Append "length" bytes of "data" to "lb" to be written later. Returns false
+ * and appends nothing if there is not space for all of them.
+ */
+bool linebuf_put(struct linebuf *lb, const char *data, size_t length)
+{
+	if (length > linebuf_space(lb))
+		return false;
+
+	linebuf_compact(lb);
+
+	memcpy(lb->data + lb->end, data, length);
+	lb->end += length;
+
+	return true;
+}
+
+
+/*
+ * Write what "fd" will take of the bytes waiting in "lb", up to "max" bytes.
+ * Returns the number of bytes written or -1 on error, including when "fd" is
+ * full (EAGAIN).
+ */
+ssize_t linebuf_flush(struct linebuf *lb, int fd, size_t max)
+{
+	ssize_t n;
+
+	if (max > linebuf_length(lb))
+		max = linebuf_length(lb);
+
+	if (max == 0)
+		return 0;
+
+	n = write(fd, lb->data + lb->start, max);
+
+	if (n > 0)
+		lb->start += n;
+
+	if (lb->start == lb->end) {
+		lb->start = 0;
+		lb->end = 0;
+	}
+
 	return n;
 }
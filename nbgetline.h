@@ -1 +1,32 @@
-ssize_t nonblock_getline(char *lineptr, FILE *stream);
+#ifndef H_NBGETLINE
+#define H_NBGETLINE
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define LINEBUF_LEN	4096
+
+
+/*
+ * Bytes read from or waiting to be written to a non-blocking descriptor.
+ * Unconsumed bytes are data[start] to data[end - 1]. The extra byte leaves
+ * room to terminate a line that fills the buffer.
+ */
+struct linebuf {
+	char data[LINEBUF_LEN + 1];
+	size_t start;
+	size_t end;
+	bool eof;
+};
+
+
+void linebuf_init(struct linebuf *lb);
+size_t linebuf_length(const struct linebuf *lb);
+size_t linebuf_space(const struct linebuf *lb);
+ssize_t linebuf_fill(struct linebuf *lb, int fd);
+ssize_t linebuf_getline(struct linebuf *lb, char *line, size_t size);
+char *linebuf_next(struct linebuf *lb, size_t *length);
+bool linebuf_put(struct linebuf *lb, const char *data, size_t length);
+ssize_t linebuf_flush(struct linebuf *lb, int fd, size_t max);
+
+#endif
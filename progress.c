@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "point.h"
+#include "gvm.h"
+#include "motion.h"
+#include "progress.h"
+
+
+/*
+ * Return pointer to axis "i" of "p" where X, Y, Z and E are 0 to 3.
+ */
+static long int *axis(struct point *p, int i)
+{
+	switch (i) {
+	case 0:
+		return &(p->x);
+	case 1:
+		return &(p->y);
+	case 2:
+		return &(p->z);
+	default:
+		return &(p->e);
+	}
+}
+
+
+/*
+ * Step the lookup gvm through one line. Returns -1 at the end of the file.
+ */
+static int progress_step(struct progress *p)
+{
+	struct point delta;
+
+	if (gvm_step(&(p->m)) == -1)
+		return -1;
+
+	motion_step(&(p->mo), &(p->m));
+
+	/* Filament is measured in physical units once located */
+	gvm_get_delta(&(p->m), &delta, true);
+	p->extruded += delta.e;
+	p->line++;
+
+	return 0;
+}
+
+
+/*
+ * Record the state before the next line as a checkpoint, halving the
+ * checkpoints and doubling the stride when full.
+ */
+static void progress_mark(struct progress *p)
+{
+	struct checkpoint *c;
+	size_t i;
+	int h;
+
+	if (p->count == PROGRESS_CHECKPOINTS) {
+		for (i = 0; i < p->count / 2; i++)
+			p->checkpoints[i] = p->checkpoints[i * 2];
+
+		p->count /= 2;
+		p->stride *= 2;
+
+		if (p->line % p->stride != 0)
+			return;
+	}
+
+	c = &(p->checkpoints[p->count++]);
+
+	c->line = p->line;
+	c->position = gvm_tell(&(p->m));
+	c->filament = p->extruded;
+	c->elapsed = p->mo.elapsed;
+
+	c->mode = p->m.mode;
+	c->located = p->m.located;
+
+	for (i = 0; i < 4; i++) {
+		c->axes[0][i] = *axis(&(p->m.position), i);
+		c->axes[1][i] = *axis(&(p->m.offset), i);
+	}
+
+	c->feedrate = p->m.feedrate;
+	c->fan = p->m.fan;
+
+	for (h = 0; h < HEATERS; h++) {
+		c->target[h] = p->m.temperature[h];
+		c->temperature[h] = p->mo.temperature[h];
+	}
+}
+
+
+/*
+ * Restore the lookup gvm to checkpoint "c".
+ */
+static void progress_restore(struct progress *p, struct checkpoint *c)
+{
+	int i;
+
+	gvm_seek(&(p->m), c->position, c->line);
+
+	p->m.mode = c->mode;
+	p->m.located = c->located;
+
+	for (i = 0; i < 4; i++) {
+		*axis(&(p->m.position), i) = c->axes[0][i];
+		*axis(&(p->m.offset), i) = c->axes[1][i];
+	}
+
+	p->m.feedrate = c->feedrate;
+	p->m.fan = c->fan;
+
+	for (i = 0; i < HEATERS; i++) {
+		p->m.temperature[i] = c->target[i];
+		p->mo.temperature[i] = c->temperature[i];
+	}
+
+	p->mo.elapsed = c->elapsed;
+	p->extruded = c->filament;
+	p->line = c->line;
+}
+
+
+/*
+ * Open the lookup gvm at the start of the file.
+ */
+static void progress_open(struct progress *p)
+{
+	gvm_init(&(p->m), false);
+	gvm_load(&(p->m), p->filename);
+	motion_init(&(p->mo));
+
+	p->line = 0;
+	p->extruded = 0;
+	p->open = true;
+}
+
+
+/*
+ * Initialise "p" for gcode file "filename", which must outlive it.
+ */
+void progress_init(struct progress *p, const char *filename)
+{
+	memset(p, 0, sizeof(struct progress));
+
+	p->filename = filename;
+	p->stride = 1;
+}
+
+
+/*
+ * Start stepping through the file to record the totals and checkpoints, a
+ * slice at a time with progress_advance().
+ */
+void progress_start(struct progress *p)
+{
+	free(p->checkpoints);
+
+	p->checkpoints = (struct checkpoint *)malloc(PROGRESS_CHECKPOINTS *
+						sizeof(struct checkpoint));
+
+	if (p->checkpoints == NULL)
+		bail("progress_start");
+
+	p->count = 0;
+	p->stride = 1;
+	p->built = false;
+
+	if (p->open)
+		gvm_close(&(p->m));
+
+	progress_open(p);
+}
+
+
+/*
+ * Step through up to "lines" more lines of the file recording checkpoints.
+ * Returns true once the end is reached and the totals are set.
+ */
+bool progress_advance(struct progress *p, uint64_t lines)
+{
+	uint64_t i;
+
+	for (i = 0; i < lines; i++) {
+		if (p->line % p->stride == 0)
+			progress_mark(p);
+
+		if (progress_step(p) == -1) {
+			p->lines = p->line;
+			p->filament = p->extruded;
+			p->elapsed = p->mo.elapsed;
+			p->built = true;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * Step through the whole file recording the totals and checkpoints.
+ */
+void progress_build(struct progress *p)
+{
+	progress_start(p);
+	progress_advance(p, UINT64_MAX);
+}
+
+
+/*
+ * Step the lookup gvm to the state after the first "line" lines, resuming
+ * from the nearest checkpoint unless the last lookup is already closer, and
+ * return it.
+ */
+struct gvm *progress_seek(struct progress *p, uint64_t line)
+{
+	uint64_t n;
+
+	if (!p->open)
+		progress_open(p);
+
+	n = line / p->stride;
+
+	if (n >= p->count)
+		n = p->count - 1;
+
+	if (p->line > line || p->checkpoints[n].line > p->line)
+		progress_restore(p, &(p->checkpoints[n]));
+
+	while (p->line < line && progress_step(p) != -1);
+
+	return &(p->m);
+}
+
+
+/*
+ * Set "filament" and "elapsed" to the totals after the first "line" lines.
+ * Lookups of increasing lines step on from the last one.
+ */
+void progress_at(struct progress *p, uint64_t line, int64_t *filament,
+							double *elapsed)
+{
+	if (line >= p->lines) {
+		*filament = p->filament;
+		*elapsed = p->elapsed;
+		return;
+	}
+
+	progress_seek(p, line);
+
+	*filament = p->extruded;
+	*elapsed = p->mo.elapsed;
+}
+
+
+/*
+ * Release the checkpoints and lookup gvm.
+ */
+void progress_free(struct progress *p)
+{
+	if (p->open)
+		gvm_close(&(p->m));
+
+	free(p->checkpoints);
+
+	p->checkpoints = NULL;
+	p->count = 0;
+	p->open = false;
+}
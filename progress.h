@@ -0,0 +1,71 @@
+#ifndef H_PROGRESS
+#define H_PROGRESS
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gvm.h"
+#include "motion.h"
+
+/* Checkpoints kept before halving them, so at least half this many remain */
+#define PROGRESS_CHECKPOINTS	2048
+
+
+/*
+ * State of the gvm and motion model before line "line", enough to resume
+ * stepping from there. "position" is the reader position from gvm_tell().
+ * Filament is the total in micro meters extruded before the line.
+ */
+struct checkpoint {
+	uint64_t line;
+	uint64_t position;
+	int64_t filament;
+	double elapsed;
+
+	int32_t mode;
+	int32_t located;
+	int64_t axes[2][4];	/* position and offset */
+	int64_t feedrate;
+	int64_t fan;
+	int64_t target[HEATERS];
+	double temperature[HEATERS];
+};
+
+
+/*
+ * Filament and estimated time totals of a gcode file with checkpoints every
+ * "stride" lines. The totals at any line are found by stepping from the
+ * checkpoint before it so memory use is bounded whatever the file size.
+ */
+struct progress {
+	const char *filename;
+
+	/* Totals and checkpoints are complete */
+	bool built;
+	uint64_t lines;
+	int64_t filament;
+	double elapsed;
+
+	uint64_t stride;
+	size_t count;
+	struct checkpoint *checkpoints;
+
+	/* gvm and totals of the last lookup */
+	bool open;
+	struct gvm m;
+	struct motion mo;
+	uint64_t line;
+	int64_t extruded;
+};
+
+
+void progress_init(struct progress *p, const char *filename);
+void progress_start(struct progress *p);
+bool progress_advance(struct progress *p, uint64_t lines);
+void progress_build(struct progress *p);
+struct gvm *progress_seek(struct progress *p, uint64_t line);
+void progress_at(struct progress *p, uint64_t line, int64_t *filament,
+							double *elapsed);
+void progress_free(struct progress *p);
+
+#endif
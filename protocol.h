@@ -2,9 +2,25 @@
 #define MSG_ACK_LEN		2
 #define MSG_DUD			"rs 0 Dud"
 #define MSG_DUD_LEN		8
+#define MSG_RESEND		"Resend:"
+#define MSG_RESEND_LEN		7
+#define MSG_RS			"rs "
+#define MSG_RS_LEN		3
 #define MSG_CMD			"#ag:"
 #define MSG_CMD_LEN		4
 
 #define MSG_CMD_EXIT		"#ag:exit"
 #define MSG_CMD_EXIT_LEN	8
+#define MSG_CMD_SOURCE		"#ag:src "
+#define MSG_CMD_SOURCE_LEN	8
+
+/* Priority commands, acted on as soon as they are read */
+#define MSG_CMD_URGENT		"#ag:urgent "
+#define MSG_CMD_URGENT_LEN	11
+#define MSG_CMD_PAUSE		"#ag:pause"
+#define MSG_CMD_PAUSE_LEN	9
+#define MSG_CMD_RESUME		"#ag:resume"
+#define MSG_CMD_RESUME_LEN	10
+#define MSG_CMD_ABORT		"#ag:abort"
+#define MSG_CMD_ABORT_LEN	9
 
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "point.h"
+#include "gvm.h"
+#include "record.h"
+
+
+/*
+ * Narrow a fixed-point value to the width stored in a record.
+ */
+static int32_t narrow(long int value)
+{
+	if (value > INT32_MAX || value < INT32_MIN) {
+		fprintf(stderr, "gcode error: value too large to compile\n");
+		exit(1);
+	}
+
+	return (int32_t)value;
+}
+
+
+/*
+ * Return true if "path" holds compiled gcode.
+ */
+bool record_probe(const char *path)
+{
+	char magic[RECORD_MAGIC_LEN];
+	FILE *stream;
+	bool found;
+
+	stream = fopen(path, "r");
+
+	if (stream == NULL)
+		return false;
+
+	found = fread(magic, RECORD_MAGIC_LEN, 1, stream) == 1 &&
+			memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_LEN) == 0;
+
+	fclose(stream);
+
+	return found;
+}
+
+
+/*
+ * Compile gcode file "input" into a stream of records written to "output".
+ * Returns the number of records written.
+ */
+uint64_t record_compile(const char *input, const char *output, bool verbose)
+{
+	struct record_header header;
+	struct record r;
+
+	struct gvm m;
+	struct command cmd;
+	struct point values;
+	enum axismask mask;
+
+	FILE *stream;
+	size_t offset;
+	int rc;
+
+	memset(&header, 0, sizeof(struct record_header));
+	memcpy(header.magic, RECORD_MAGIC, RECORD_MAGIC_LEN);
+	header.version = RECORD_VERSION;
+	header.size = sizeof(struct record);
+
+	gvm_init(&m, verbose);
+	gvm_load(&m, input);
+
+	if (m.records) {
+		fprintf(stderr, "%s is already compiled\n", input);
+		exit(1);
+	}
+
+	stream = fopen(output, "w");
+
+	if (stream == NULL)
+		bail("record_compile");
+
+	/* Reserve space for the header until the count is known */
+	if (fwrite(&header, sizeof(struct record_header), 1, stream) != 1)
+		bail("record_compile");
+
+	do {
+		memset(&r, 0, sizeof(struct record));
+		memset(&cmd, 0, sizeof(struct command));
+		point_clear(&values, NULL);
+
+		offset = gvm_get_offset(&m);
+		rc = gvm_read(&m, &cmd, &values, &mask);
+
+		if (rc == 0) {
+			r.prefix = cmd.prefix;
+			r.code = cmd.code;
+			r.mask = mask;
+			r.params = cmd.params;
+			r.flags |= RECORD_VALID;
+
+			r.x = narrow(values.x);
+			r.y = narrow(values.y);
+			r.z = narrow(values.z);
+			r.e = narrow(values.e);
+			r.f = narrow(cmd.f);
+			r.s = narrow(cmd.s);
+			r.p = narrow(cmd.p);
+		}
+
+		if (gvm_eof(&m))
+			r.flags |= RECORD_EOF;
+
+		r.line = header.count + 1;
+		r.offset = offset;
+
+		if (fwrite(&r, sizeof(struct record), 1, stream) != 1)
+			bail("record_compile");
+
+		header.count++;
+	} while (!(r.flags & RECORD_EOF));
+
+	gvm_close(&m);
+
+	if (fseek(stream, 0, SEEK_SET) != 0)
+		bail("record_compile");
+
+	if (fwrite(&header, sizeof(struct record_header), 1, stream) != 1)
+		bail("record_compile");
+
+	if (fclose(stream) != 0)
+		bail("record_compile");
+
+	return header.count;
+}
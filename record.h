@@ -0,0 +1,58 @@
+#ifndef H_RECORD
+#define H_RECORD
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RECORD_MAGIC		"AGCB"
+#define RECORD_MAGIC_LEN	4
+#define RECORD_VERSION		2
+
+/* The line decoded into a command that should be applied */
+#define RECORD_VALID		0x1
+/* The gvm reached the end of the file while reading the line */
+#define RECORD_EOF		0x2
+
+
+/*
+ * Compiled gcode starts with this header followed by "count" records. Both
+ * are stored in native byte order.
+ */
+struct record_header {
+	char magic[RECORD_MAGIC_LEN];
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t count;
+};
+
+
+/*
+ * One gvm step. Axis values and parameters are fixed-point as in struct point
+ * and struct command, "line" is the 1-based source line and "offset" the
+ * byte offset of its start.
+ */
+struct record {
+	char prefix;
+	uint8_t mask;
+	uint8_t params;
+	uint8_t flags;
+	uint32_t code;
+
+	int32_t x;
+	int32_t y;
+	int32_t z;
+	int32_t e;
+	int32_t f;
+	int32_t s;
+	int32_t p;
+
+	uint32_t line;
+	uint64_t offset;
+};
+
+
+bool record_probe(const char *path);
+uint64_t record_compile(const char *input, const char *output, bool verbose);
+
+#endif
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE /* sysconf */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "point.h"
+#include "gvm.h"
+#include "scan.h"
+
+
+/*
+ * Return pointer to axis "i" of "p" where X, Y, Z and E are 0 to 3.
+ */
+static long int *axis(struct point *p, int i)
+{
+	switch (i) {
+	case 0:
+		return &(p->x);
+	case 1:
+		return &(p->y);
+	case 2:
+		return &(p->z);
+	default:
+		return &(p->e);
+	}
+}
+
+
+/*
+ * Set "f" to the constant "c".
+ */
+static void form_set(struct form *f, long int c)
+{
+	f->kpos = 0;
+	f->koff = 0;
+	f->c = c;
+}
+
+
+/*
+ * Evaluate "f" for an axis that started at "position" with "offset".
+ */
+static long int form_eval(struct form *f, long int position, long int offset)
+{
+	return (f->kpos * position) + (f->koff * offset) + f->c;
+}
+
+
+/*
+ * Initialise "t" to the identity transfer.
+ */
+static void transfer_init(struct transfer *t)
+{
+	int v, i;
+
+	t->undeclared = false;
+	t->located = false;
+	t->mode = MODE_NONE;
+
+	for (v = 0; v < 2; v++) {
+		for (i = 0; i < 4; i++) {
+			form_set(&(t->position[v][i]), 0);
+			t->position[v][i].kpos = 1;
+
+			form_set(&(t->offset[v][i]), 0);
+			t->offset[v][i].koff = 1;
+		}
+	}
+}
+
+
+/*
+ * Apply a command to "t" as gvm_apply() would apply it to a gvm.
+ */
+static void transfer_apply(struct transfer *t, struct command *cmd,
+				struct point *values, enum axismask mask)
+{
+	struct form *pos;
+	struct form *off;
+	enum coordmode mode;
+	int v, i;
+
+	if (cmd->prefix != 'G')
+		return;
+
+	switch (cmd->code) {
+	case 0:
+	case 1:
+		if (t->mode == MODE_NONE)
+			t->undeclared = true;
+
+		for (v = 0; v < 2; v++) {
+			mode = t->mode;
+
+			if (mode == MODE_NONE)
+				mode = v ? MODE_RELATIVE : MODE_ABSOLUTE;
+
+			for (i = 0; i < 4; i++) {
+				if (!(mask & (1 << i)))
+					continue;
+
+				pos = &(t->position[v][i]);
+
+				if (mode == MODE_ABSOLUTE)
+					form_set(pos, *axis(values, i));
+				else
+					pos->c += *axis(values, i);
+			}
+		}
+		break;
+
+	case 28:
+		for (v = 0; v < 2; v++) {
+			for (i = 0; i < 4; i++) {
+				if (!(mask & (1 << i)))
+					continue;
+
+				form_set(&(t->position[v][i]), 0);
+				form_set(&(t->offset[v][i]), 0);
+			}
+		}
+
+		t->located = true;
+		break;
+
+	case 90:
+		t->mode = MODE_ABSOLUTE;
+		break;
+
+	case 91:
+		t->mode = MODE_RELATIVE;
+		break;
+
+	case 92:
+		for (v = 0; v < 2; v++) {
+			for (i = 0; i < 4; i++) {
+				if (!(mask & (1 << i)))
+					continue;
+
+				pos = &(t->position[v][i]);
+				off = &(t->offset[v][i]);
+
+				off->kpos -= pos->kpos;
+				off->koff -= pos->koff;
+				off->c += *axis(values, i) - pos->c;
+
+				form_set(pos, *axis(values, i));
+			}
+		}
+		break;
+	}
+}
+
+
+/*
+ * First pass over a chunk, recording its effect on the gvm state.
+ */
+static void *scan_transfer(void *arg)
+{
+	struct chunk *c = arg;
+	struct command cmd;
+	struct point values;
+	enum axismask mask;
+
+	transfer_init(&(c->transfer));
+
+	while (1) {
+		if (gvm_read(&(c->m), &cmd, &values, &mask) == 0)
+			transfer_apply(&(c->transfer), &cmd, &values, mask);
+
+		if (gvm_eof(&(c->m)))
+			break;
+
+		c->lines++;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Call "fn" for every chunk, one thread per chunk.
+ */
+static void scan_threads(struct scan *s, void *(*fn)(void *))
+{
+	pthread_t *threads;
+	unsigned int i;
+
+	threads = (pthread_t *)malloc(s->count * sizeof(pthread_t));
+
+	if (threads == NULL)
+		bail("scan_threads");
+
+	for (i = 0; i < s->count; i++) {
+		if (pthread_create(&(threads[i]), NULL, fn,
+							&(s->chunks[i])) != 0)
+			bail("pthread_create");
+	}
+
+	for (i = 0; i < s->count; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
+
+
+/*
+ * Prepare the gvm of each chunk to step from the start of the chunk.
+ */
+static void scan_reset(struct scan *s)
+{
+	struct chunk *c;
+	unsigned int i;
+
+	for (i = 0; i < s->count; i++) {
+		c = &(s->chunks[i]);
+
+		gvm_init(&(c->m), false);
+		gvm_view(&(c->m), &(s->m), c->start, c->end);
+
+		c->m.mode = c->mode;
+		c->m.located = c->located;
+		c->m.position = c->position;
+		c->m.offset = c->offset;
+	}
+}
+
+
+/*
+ * Resolve the starting state of every chunk from the transfers of the chunks
+ * before it.
+ */
+static void scan_resolve(struct scan *s)
+{
+	struct chunk *c;
+	struct point position;
+	struct point offset;
+	enum coordmode mode = MODE_NONE;
+	bool located = false;
+	unsigned int base = 0;
+	unsigned int n;
+	int v, i;
+
+	point_clear(&position, NULL);
+	point_clear(&offset, NULL);
+
+	for (n = 0; n < s->count; n++) {
+		c = &(s->chunks[n]);
+
+		c->base = base;
+		c->mode = mode;
+		c->located = located;
+		c->position = position;
+		c->offset = offset;
+
+		if (mode == MODE_NONE && c->transfer.undeclared) {
+			fprintf(stderr, "gcode error: mode undeclared\n");
+			exit(1);
+		}
+
+		v = (mode == MODE_RELATIVE);
+
+		for (i = 0; i < 4; i++) {
+			*axis(&position, i) = form_eval(
+					&(c->transfer.position[v][i]),
+					*axis(&(c->position), i),
+					*axis(&(c->offset), i));
+
+			*axis(&offset, i) = form_eval(
+					&(c->transfer.offset[v][i]),
+					*axis(&(c->position), i),
+					*axis(&(c->offset), i));
+		}
+
+		if (c->transfer.mode != MODE_NONE)
+			mode = c->transfer.mode;
+
+		located = located || c->transfer.located;
+		base += c->lines;
+	}
+}
+
+
+/*
+ * Return the number of processors available for parallel analysis.
+ */
+unsigned int scan_jobs(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+
+	return (unsigned int)n;
+}
+
+
+/*
+ * Split "filename" into up to "jobs" chunks at line boundaries and resolve
+ * the gvm state at the start of each. Returns -1 if the file cannot be
+ * mapped or is compiled, in which case it must be analysed serially.
+ */
+int scan_load(struct scan *s, const char *filename, unsigned int jobs)
+{
+	struct chunk *c;
+	const char *found;
+	size_t start = 0;
+	size_t end;
+	unsigned int i;
+
+	gvm_init(&(s->m), false);
+	gvm_load(&(s->m), filename);
+
+	if (!s->m.map || s->m.records) {
+		gvm_close(&(s->m));
+		return -1;
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+
+	s->count = 0;
+	s->chunks = (struct chunk *)calloc(jobs, sizeof(struct chunk));
+
+	if (s->chunks == NULL)
+		bail("scan_load");
+
+	for (i = 0; i < jobs && start < s->m.length; i++) {
+		end = s->m.length / jobs * (i + 1);
+
+		if (end < start)
+			end = start;
+
+		found = NULL;
+
+		if (i < jobs - 1)
+			found = memchr(s->m.map + end, '\n', s->m.length - end);
+
+		end = found ? (size_t)(found - s->m.map) + 1 : s->m.length;
+
+		c = &(s->chunks[s->count++]);
+		c->start = start;
+		c->end = end;
+
+		start = end;
+	}
+
+	for (i = 0; i < s->count; i++) {
+		c = &(s->chunks[i]);
+
+		gvm_init(&(c->m), false);
+		gvm_view(&(c->m), &(s->m), c->start, c->end);
+	}
+
+	scan_threads(s, scan_transfer);
+	scan_resolve(s);
+
+	return 0;
+}
+
+
+/*
+ * Call "fn" in parallel for every chunk with the chunk's gvm positioned at the
+ * start of the chunk in the state the serial gvm would have there.
+ */
+void scan_run(struct scan *s, void *(*fn)(void *))
+{
+	scan_reset(s);
+	scan_threads(s, fn);
+}
+
+
+/*
+ * Release the chunks and the mapped file.
+ */
+void scan_close(struct scan *s)
+{
+	free(s->chunks);
+	s->chunks = NULL;
+	s->count = 0;
+
+	gvm_close(&(s->m));
+}
@@ -0,0 +1,72 @@
+#ifndef H_SCAN
+#define H_SCAN
+
+#include <stdbool.h>
+
+#include "point.h"
+#include "gvm.h"
+
+
+/*
+ * Value of an axis after a chunk as a linear function of the position and
+ * offset of that axis before the chunk.
+ */
+struct form {
+	int kpos;
+	int koff;
+	long int c;
+};
+
+
+/*
+ * Effect of a chunk on the gvm state. Moves made before the chunk declares a
+ * mode depend on the mode it was entered in, so both outcomes are kept.
+ */
+struct transfer {
+	bool undeclared;
+	bool located;
+	enum coordmode mode;
+
+	/* indexed by [entry mode relative][axis] */
+	struct form position[2][4];
+	struct form offset[2][4];
+};
+
+
+struct chunk {
+	size_t start;
+	size_t end;
+
+	unsigned int lines;
+	unsigned int base;
+
+	struct transfer transfer;
+
+	/* gvm state at the start of the chunk */
+	enum coordmode mode;
+	bool located;
+	struct point position;
+	struct point offset;
+
+	/* view stepping through the chunk from the state above */
+	struct gvm m;
+
+	/* analysis results */
+	void *data;
+};
+
+
+struct scan {
+	struct gvm m;
+
+	unsigned int count;
+	struct chunk *chunks;
+};
+
+
+unsigned int scan_jobs(void);
+int scan_load(struct scan *s, const char *filename, unsigned int jobs);
+void scan_run(struct scan *s, void *(*fn)(void *));
+void scan_close(struct scan *s);
+
+#endif
@@ -11,6 +11,7 @@
 
 
 #define _BSD_SOURCE /* CRTSCTS */
+#define _GNU_SOURCE /* clock_gettime */
 #include <stdio.h>
 #include <stdlib.h> 
 #include <stdint.h>
@@ -19,8 +20,16 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
+#if defined(__linux__)
+#include <linux/serial.h>
+#endif
+
+#include "nbgetline.h"
+#include "baud.h"
 #include "serial.h"
 
 
@@ -34,7 +43,7 @@ int serial_init(const char* serialport, int baud)
 	int serial;
 	speed_t brate;
 
-	serial = open(serialport, O_RDWR | O_NOCTTY);
+	serial = open(serialport, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
 	if (serial == -1)
 		return -1;
@@ -100,7 +109,7 @@ int serial_init(const char* serialport, int baud)
 #endif
 #ifdef B500000
 		case 500000:
-			brate=B460800;
+			brate=B500000;
 			break;
 #endif
 #ifdef B576000
@@ -109,12 +118,14 @@ int serial_init(const char* serialport, int baud)
 			break;
 #endif
 		default:
-			perror("Invalid baudrate");
-			return -1;
+			/* Set after the other options with termios2 */
+			brate = B0;
 	}
 
-	cfsetispeed(&toptions, brate);
-	cfsetospeed(&toptions, brate);
+	if (brate != B0) {
+		cfsetispeed(&toptions, brate);
+		cfsetospeed(&toptions, brate);
+	}
 
 	/* 8N1 */
 	toptions.c_cflag &= ~PARENB;
@@ -135,53 +146,118 @@ int serial_init(const char* serialport, int baud)
 	toptions.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
 	toptions.c_oflag &= ~OPOST;
 
-	/* set blocking method */
+	/* never block, reads wait in poll() */
 	toptions.c_cc[VMIN] = SERIAL_VMIN;
 	toptions.c_cc[VTIME] = SERIAL_VTIME;
 
 	if (tcsetattr(serial, TCSANOW, &toptions) < 0)
 		return -1;
 
+	if (brate == B0 && baud_set(serial, baud) == -1) {
+		perror("Invalid baudrate");
+		return -1;
+	}
+
 	return serial;
 }
 
 
 /*
- * Read a complete line from the serial port
+ * Leave DTR raised when serial port "serial" is closed so that opening it
+ * again does not reset boards that reset when DTR is raised.
  */
-int serial_getline(int serial, char *buffer, int timeout)
+int serial_no_hangup(int serial)
 {
-	int nbytes, i = 0;
-	int retries = (timeout * 10) / SERIAL_VTIME;
-	char byte[1];
+	struct termios toptions;
 
-	do {
-		/* Block until one character received or timeout */
-		nbytes = read(serial, byte, 1);
+	if (tcgetattr(serial, &toptions) < 0)
+		return -1;
 
-		/* Return if in error state */
-		if (nbytes == -1)
-			return -1;
+	toptions.c_cflag &= ~HUPCL;
 
-		/* Try again if timed out */
-		if (nbytes == 0) {
-			retries--;
-			continue;
+	return tcsetattr(serial, TCSANOW, &toptions);
+}
+
+
+/*
+ * Ask the driver of serial port "serial" to pass on received bytes without
+ * delay rather than in batches. Returns -1 if the driver does not support it.
+ */
+int serial_low_latency(int serial)
+{
+#ifdef ASYNC_LOW_LATENCY
+	struct serial_struct options;
+
+	if (ioctl(serial, TIOCGSERIAL, &options) == -1)
+		return -1;
+
+	options.flags |= ASYNC_LOW_LATENCY;
+
+	return ioctl(serial, TIOCSSERIAL, &options);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+
+/*
+ * Return a monotonic time in milliseconds for timing serial deadlines.
+ */
+long int serial_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long int)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * Read a complete line from the serial port into "lb", reading whatever is
+ * available at a time, and set "line" to it in place as linebuf_next() does.
+ * Returns the length of the line or -1 on error or if no line arrives within
+ * "timeout" milliseconds.
+ */
+ssize_t serial_getline(int serial, struct linebuf *lb, char **line,
+							long int timeout)
+{
+	struct pollfd fds;
+	long int deadline = serial_clock() + timeout;
+	long int remaining;
+	size_t length;
+	ssize_t n;
+
+	while ((*line = linebuf_next(lb, &length)) == NULL) {
+		remaining = deadline - serial_clock();
+
+		if (remaining <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
 		}
 
-		/* Otherwise add the new byte to the buffer */
-		buffer[i] = byte[0];
-		i++;
+		fds.fd = serial;
+		fds.events = POLLIN;
+
+		n = poll(&fds, 1, remaining);
+
+		if (n == -1 && errno != EINTR)
+			return -1;
+
+		if (n <= 0)
+			continue;
 
-	} while (byte[0] != '\n' && retries > 0);
+		n = linebuf_fill(lb, serial);
 
-	/* Remove end of line characters and null terminate the string */
-	if (buffer[i - 2] == '\r')
-		i -= 2;
-	else
-		i -= 1;
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
 
-	buffer[i] = 0;
+		if (n == -1 && errno != EAGAIN)
+			return -1;
+	}
 
-	return i;
+	return length;
 }
@@ -1,6 +1,12 @@
+#include "nbgetline.h"
+
 #define SERIAL_VMIN	0
-#define SERIAL_VTIME	1
+#define SERIAL_VTIME	0
 
 
+long int serial_clock(void);
 int serial_init(const char* serialport, int baud);
-int serial_getline(int serial, char *buffer, int timeout);
+int serial_low_latency(int serial);
+int serial_no_hangup(int serial);
+ssize_t serial_getline(int serial, struct linebuf *lb, char **line,
+							long int timeout);
@@ -2,17 +2,56 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 
+#include "common.h"
 #include "point.h"
 #include "gvm.h"
+#include "scan.h"
 #include "stats.h"
 
+/* Lines decoded per gvm_step_batch() call */
+#define BATCH_LINES 4096
+
 #define MIN(p, q) (((p) < (q)) ? (p) : (q))
 #define MAX(p, q) (((p) >= (q)) ? (p) : (q))
 
 
+/*
+ * Options and running state of one extends measurement.
+ */
+struct extends_pass {
+	bool deposition;
+	bool zmode;
+	long int zmin;
+	struct region *ignore;
+	bool verbose;
+
+	bool started;
+
+	/* -1 while unknown at the start of a parallel chunk */
+	int iglast;
+
+	struct extends bounds;
+
+	/* previous point of the first line recorded while iglast is unknown */
+	bool has_first;
+	struct extends first;
+};
+
+
+/*
+ * Per chunk results of a parallel extends measurement, for chunks entered
+ * after and before deposition started.
+ */
+struct extends_chunk {
+	bool physical;
+	struct extends_pass pass[2];
+};
+
+
 void bounds_clear(struct extends *value)
 {
 	value->x.min = LONG_MAX;
@@ -30,163 +69,493 @@ void bounds_clear(struct extends *value)
 
 
 /*
- * Generate an array containing the total length of filament extruded at the
- * end of each line in the gcode file.
+ * Extend "dst" to include the bounds of "src".
  */
-float get_progress_table(unsigned int **table, size_t *lines,
-							const char *filename)
+static void bounds_merge(struct extends *dst, struct extends *src)
 {
-	struct gvm m;
-	struct point delta;
+	dst->x.min = MIN(dst->x.min, src->x.min);
+	dst->x.max = MAX(dst->x.max, src->x.max);
 
-	static const size_t grow = 2000;
-	size_t capacity = grow;
+	dst->y.min = MIN(dst->y.min, src->y.min);
+	dst->y.max = MAX(dst->y.max, src->y.max);
 
-	float extruded = 0.0;
+	dst->z.min = MIN(dst->z.min, src->z.min);
+	dst->z.max = MAX(dst->z.max, src->z.max);
 
-	if (*table == NULL) {
-		*table = (unsigned int*)malloc(capacity *
-							sizeof(unsigned int));
-	}
+	dst->e.min = MIN(dst->e.min, src->e.min);
+	dst->e.max = MAX(dst->e.max, src->e.max);
+}
 
-	*lines = 0;
 
-	gvm_init(&m, false);
-	gvm_load(&m, filename);
+/*
+ * Initialise an extends measurement.
+ */
+static void extends_init(struct extends_pass *p, bool deposition, bool zmode,
+		long int zmin, struct region *ignore, bool verbose)
+{
+	p->deposition = deposition;
+	p->zmode = zmode;
+	p->zmin = zmin;
+	p->ignore = ignore;
+	p->verbose = verbose;
 
-	while (gvm_step(&m) != -1) {
-		gvm_get_delta(&m, &delta, true);
-		extruded += delta.e;
+	p->started = false;
+	p->iglast = false;
 
-		(*table)[*lines] = (unsigned int)extruded;
-		(*lines)++;
+	bounds_clear(&(p->bounds));
 
-		/* Grow the table if necessary */
-		if (*lines >= capacity) {
-			capacity += grow;
-			*table = realloc(*table, capacity *
-						sizeof(unsigned int));
+	p->has_first = false;
+	bounds_clear(&(p->first));
+}
+
+
+/*
+ * Update an extends measurement with the position and delta of one line.
+ */
+static void extends_update(struct extends_pass *p, struct point *pos,
+							struct point *delta)
+{
+	struct extends *prev = &(p->bounds);
+
+	/* Always update E bounds. */
+	p->bounds.e.min = MIN(p->bounds.e.min, pos->e);
+	p->bounds.e.max = MAX(p->bounds.e.max, pos->e);
+
+	/* See if new point is inside ignore region. */
+	if (p->ignore != NULL) {
+		if (pos->x >= p->ignore->x1 && pos->y <= p->ignore->x2
+				&& pos->y >= p->ignore->y1
+				&& pos->y <= p->ignore->y2) {
+
+			if (p->verbose)
+				fprintf(stderr, "ignore region\n");
+
+			p->iglast = true;
+			return;
 		}
 	}
 
-	/* Free any un-used memory */
-	if (*lines < capacity)
-		*table = realloc(*table, *lines * sizeof(unsigned int));
+	/*
+	 * When print head is moved while extruding for first
+	 * time consider to have started printing.
+	 */
+	if (p->deposition && !p->started) {
+		if (delta->e > 0.0 && delta->x + delta->y > 0.0) {
+			p->started = true;
 
-	gvm_close(&m);
+			if (p->verbose)
+				fprintf(stderr, "DEPOSITION STARTED\n");
+		}
+	}
+
+	/*
+	 * In deposition mode only record extends while
+	 * depositing.
+	 */
+	if (p->deposition && (!p->started || delta->e <= 0.0))
+		return;
+
+	/*
+	 * In zmode only record extends while Z axis is within
+	 * unsafe area.
+	 */
+	if (p->zmode && pos->z > p->zmin && pos->z - delta->z > p->zmin)
+		return;
+
+	p->bounds.x.min = MIN(p->bounds.x.min, pos->x);
+	p->bounds.x.max = MAX(p->bounds.x.max, pos->x);
+
+	p->bounds.y.min = MIN(p->bounds.y.min, pos->y);
+	p->bounds.y.max = MAX(p->bounds.y.max, pos->y);
+
+	p->bounds.z.min = MIN(p->bounds.z.min, pos->z);
+	p->bounds.z.max = MAX(p->bounds.z.max, pos->z);
+
+	/*
+	 * If it is not yet known whether the line before a parallel chunk
+	 * was ignored keep its previous point aside to merge later.
+	 */
+	if (p->iglast == -1) {
+		prev = &(p->first);
+		p->has_first = true;
+	}
 
-	return extruded;
+	if (p->iglast != true) {
+		prev->x.min = MIN(prev->x.min, pos->x - delta->x);
+		prev->x.max = MAX(prev->x.max, pos->x - delta->x);
+
+		prev->y.min = MIN(prev->y.min, pos->y - delta->y);
+		prev->y.max = MAX(prev->y.max, pos->y - delta->y);
+
+		prev->z.min = MIN(prev->z.min, pos->z - delta->z);
+		prev->z.max = MAX(prev->z.max, pos->z - delta->z);
+	}
+
+	p->iglast = false;
 }
 
 
 /*
- * Calculate the extends reached while printing gcode data.
- * When deposition=false this includes all movements.
- * When deposition=true this includes only movements that deposit material on
- * the print bed.
+ * Update an extends measurement with line "i" of "b". Lines without physical
+ * values are skipped in physical mode as the machine has not been located.
  */
-size_t get_extends(struct extends *bounds, bool deposition,
-	bool physical, bool zmode, long int zmin, struct region *ignore,
-	bool verbose, const char *filename)
+static void extends_line(struct extends_pass *p, struct gvm_batch *b,
+						size_t i, bool physical)
 {
-	bool started = false;
-	bool igthis = false;
-	bool iglast = false;
-
-	struct gvm m;
-
 	struct point pos;
 	struct point delta;
 
-	if (deposition && zmode) {
-		fprintf(stderr, "deposition and zmode cannot be used\n");
-		abort();
-	}
+	if (physical && !(b->flags[i] & BATCH_PHYSICAL))
+		return;
 
-	gvm_init(&m, verbose);
-	gvm_load(&m, filename);
+	pos.x = b->x[i];
+	pos.y = b->y[i];
+	pos.z = b->z[i];
+	pos.e = b->e[i];
 
-	while (gvm_step(&m) != -1) {
-		/* in physical mode skip updating stats if machine is not
-		 * physically located */
-		if (gvm_get_position(&m, &pos, physical) == -1)
-			continue;
+	delta.x = b->dx[i];
+	delta.y = b->dy[i];
+	delta.z = b->dz[i];
+	delta.e = b->de[i];
+
+	extends_update(p, &pos, &delta);
+}
+
+
+#if defined(__GNUC__) && !defined(AG_NO_VECTOR)
+
+/* Native SSE and NEON register width */
+#define VECTOR_BYTES 16
+#define LANES (VECTOR_BYTES / sizeof(long int))
+
+typedef long int vlong __attribute__ ((vector_size (VECTOR_BYTES)));
+
+
+/*
+ * Load LANES values from "src".
+ */
+static vlong vload(const long int *src)
+{
+	vlong v;
+
+	memcpy(&v, src, sizeof(vlong));
+
+	return v;
+}
+
+
+/*
+ * Lower "*acc" to "v" in lanes where "mask" is set.
+ */
+static void vmin(vlong *acc, vlong v, vlong mask)
+{
+	*acc ^= (v ^ *acc) & ((v < *acc) & mask);
+}
+
+
+/*
+ * Raise "*acc" to "v" in lanes where "mask" is set.
+ */
+static void vmax(vlong *acc, vlong v, vlong mask)
+{
+	*acc ^= (v ^ *acc) & ((v > *acc) & mask);
+}
+
+
+/*
+ * Merge the lanes of "lo" and "hi" into "peak".
+ */
+static void vmerge(struct peaks *peak, vlong lo, vlong hi)
+{
+	size_t l;
+
+	for (l = 0; l < LANES; l++) {
+		peak->min = MIN(peak->min, lo[l]);
+		peak->max = MAX(peak->max, hi[l]);
+	}
+}
 
-		if (gvm_get_delta(&m, &delta, physical) == -1)
-			continue;
 
-		/* Always update E bounds. */
-		bounds->e.min = MIN(bounds->e.min, pos.e);
-		bounds->e.max = MAX(bounds->e.max, pos.e);
+/*
+ * Update an extends measurement with lines "i" onwards of "b" LANES lines at
+ * a time. Each predicate of extends_update() is evaluated as a lane mask so
+ * the bounds are updated without branches. Deposition must have started, or
+ * not be measured, and iglast must be known.
+ */
+static void extends_kernel(struct extends_pass *p, struct gvm_batch *b,
+						size_t i, bool physical)
+{
+	vlong zero = {0};
+	vlong lo[7];
+	vlong hi[7];
+	vlong x, y, z, e, dx, dy, dz;
+	vlong valid, keep, ign, prev;
+	int iglast = p->iglast;
+	size_t l;
+	int n;
+
+	for (n = 0; n < 7; n++) {
+		lo[n] = zero + LONG_MAX;
+		hi[n] = zero + LONG_MIN;
+	}
 
-		igthis = false;
+	ign = zero;
 
-		/* See if new point is inside ignore region. */
-		if (ignore != NULL) {
-			if (pos.x >= ignore->x1 && pos.y <= ignore->x2
-					&& pos.y >= ignore->y1
-					&& pos.y <= ignore->y2) {
+	for (; i + LANES <= b->count; i += LANES) {
+		x = vload(b->x + i);
+		y = vload(b->y + i);
+		z = vload(b->z + i);
+		e = vload(b->e + i);
+		dx = vload(b->dx + i);
+		dy = vload(b->dy + i);
+		dz = vload(b->dz + i);
 
-				if (verbose)
-					fprintf(stderr, "ignore region\n");
+		valid = zero - 1;
 
-				igthis = true;
-				iglast = true;
-				continue;
+		if (physical) {
+			for (l = 0; l < LANES; l++) {
+				if (!(b->flags[i + l] & BATCH_PHYSICAL))
+					valid[l] = 0;
 			}
 		}
 
-		/*
-		 * When print head is moved while extruding for first
-		 * time consider to have started printing.
-		 */
-		if (deposition && !started) {
-			if (delta.e > 0.0 && delta.x + delta.y > 0.0) {
-				started = true;
+		keep = valid;
+
+		if (p->ignore != NULL) {
+			ign = valid & (x >= p->ignore->x1) &
+					(y <= p->ignore->x2) &
+					(y >= p->ignore->y1) &
+					(y <= p->ignore->y2);
+			keep &= ~ign;
+		}
+
+		if (p->deposition)
+			keep &= vload(b->de + i) > 0;
+
+		if (p->zmode)
+			keep &= ~((z > p->zmin) & ((z - dz) > p->zmin));
 
-				if (verbose)
-					fprintf(stderr, "DEPOSITION STARTED\n");
+		/* The previous point follows lines recorded or ignored */
+		prev = keep;
+
+		if (p->ignore != NULL) {
+			for (l = 0; l < LANES; l++) {
+				if (ign[l]) {
+					iglast = true;
+				} else if (keep[l]) {
+					if (iglast)
+						prev[l] = 0;
+
+					iglast = false;
+				}
 			}
 		}
 
-		/*
-		 * In deposition mode only record extends while
-		 * depositing.
-		 */
-		if (deposition && (!started || delta.e <= 0.0))
-			continue;
+		vmin(&lo[0], x, keep);
+		vmax(&hi[0], x, keep);
+		vmin(&lo[1], y, keep);
+		vmax(&hi[1], y, keep);
+		vmin(&lo[2], z, keep);
+		vmax(&hi[2], z, keep);
+
+		vmin(&lo[3], x - dx, prev);
+		vmax(&hi[3], x - dx, prev);
+		vmin(&lo[4], y - dy, prev);
+		vmax(&hi[4], y - dy, prev);
+		vmin(&lo[5], z - dz, prev);
+		vmax(&hi[5], z - dz, prev);
+
+		vmin(&lo[6], e, valid);
+		vmax(&hi[6], e, valid);
+	}
 
-		/*
-		 * In zmode only record extends while Z axis is within
-		 * unsafe area.
-		 */
-		if (zmode && pos.z > zmin && pos.z - delta.z > zmin)
-			continue;
+	p->iglast = iglast;
 
-		bounds->x.min = MIN(bounds->x.min, pos.x);
-		bounds->x.max = MAX(bounds->x.max, pos.x);
+	vmerge(&(p->bounds.x), lo[0], hi[0]);
+	vmerge(&(p->bounds.y), lo[1], hi[1]);
+	vmerge(&(p->bounds.z), lo[2], hi[2]);
+	vmerge(&(p->bounds.x), lo[3], hi[3]);
+	vmerge(&(p->bounds.y), lo[4], hi[4]);
+	vmerge(&(p->bounds.z), lo[5], hi[5]);
+	vmerge(&(p->bounds.e), lo[6], hi[6]);
 
-		bounds->y.min = MIN(bounds->y.min, pos.y);
-		bounds->y.max = MAX(bounds->y.max, pos.y);
+	for (; i < b->count; i++)
+		extends_line(p, b, i, physical);
+}
 
-		bounds->z.min = MIN(bounds->z.min, pos.z);
-		bounds->z.max = MAX(bounds->z.max, pos.z);
+#else
 
-		if (!iglast) {
-			bounds->x.min = MIN(bounds->x.min, pos.x - delta.x);
-			bounds->x.max = MAX(bounds->x.max, pos.x - delta.x);
+/*
+ * Scalar fallback for compilers without vector extensions.
+ */
+static void extends_kernel(struct extends_pass *p, struct gvm_batch *b,
+						size_t i, bool physical)
+{
+	for (; i < b->count; i++)
+		extends_line(p, b, i, physical);
+}
 
-			bounds->y.min = MIN(bounds->y.min, pos.y - delta.y);
-			bounds->y.max = MAX(bounds->y.max, pos.y - delta.y);
+#endif
 
-			bounds->z.min = MIN(bounds->z.min, pos.z - delta.z);
-			bounds->z.max = MAX(bounds->z.max, pos.z - delta.z);
-		}
 
-		iglast = igthis;
+/*
+ * Update an extends measurement with every line of "b".
+ */
+static void extends_batch(struct extends_pass *p, struct gvm_batch *b,
+								bool physical)
+{
+	size_t i = 0;
+
+	/* Verbose measurements report as they go */
+	if (p->verbose) {
+		for (; i < b->count; i++)
+			extends_line(p, b, i, physical);
+
+		return;
+	}
+
+	/* Step line by line until the state the kernel needs is known */
+	for (; i < b->count && (p->iglast == -1 ||
+				(p->deposition && !p->started)); i++)
+		extends_line(p, b, i, physical);
+
+	extends_kernel(p, b, i, physical);
+}
+
+
+/*
+ * Measure the extends of one chunk both as if deposition had and had not
+ * started before it.
+ */
+static void *extends_chunk(void *arg)
+{
+	struct chunk *c = arg;
+	struct extends_chunk *data = c->data;
+	struct gvm_batch b;
+
+	gvm_batch_init(&b, BATCH_LINES);
+
+	while (gvm_step_batch(&(c->m), &b, data->physical) > 0) {
+		extends_batch(&(data->pass[0]), &b, data->physical);
+
+		if (data->pass[1].deposition)
+			extends_batch(&(data->pass[1]), &b, data->physical);
+	}
+
+	gvm_batch_free(&b);
+
+	return NULL;
+}
+
+
+/*
+ * Parallel version of get_extends(). Returns -1 if the file cannot be analysed
+ * in parallel.
+ */
+static int get_extends_parallel(struct extends *bounds, size_t *lines,
+	bool deposition, bool physical, bool zmode, long int zmin,
+	struct region *ignore, const char *filename, unsigned int jobs)
+{
+	struct scan s;
+	struct extends_chunk *data;
+	struct extends_pass *p;
+	bool started = false;
+	int iglast = false;
+	unsigned int i;
+
+	if (scan_load(&s, filename, jobs) == -1)
+		return -1;
+
+	data = calloc(s.count, sizeof(struct extends_chunk));
+
+	if (data == NULL)
+		bail("get_extends");
+
+	for (i = 0; i < s.count; i++) {
+		data[i].physical = physical;
+
+		extends_init(&(data[i].pass[0]), deposition, zmode, zmin,
+								ignore, false);
+		data[i].pass[0].started = true;
+		data[i].pass[0].iglast = -1;
+
+		extends_init(&(data[i].pass[1]), deposition, zmode, zmin,
+								ignore, false);
+		data[i].pass[1].iglast = -1;
+
+		s.chunks[i].data = &(data[i]);
 	}
 
+	scan_run(&s, extends_chunk);
+
+	*lines = 0;
+
+	for (i = 0; i < s.count; i++) {
+		p = &(data[i].pass[deposition && !started]);
+
+		bounds_merge(bounds, &(p->bounds));
+
+		if (p->has_first && iglast == false)
+			bounds_merge(bounds, &(p->first));
+
+		if (p->iglast != -1)
+			iglast = p->iglast;
+
+		started = started || p->started;
+
+		*lines += s.chunks[i].lines;
+	}
+
+	free(data);
+	scan_close(&s);
+
+	return 0;
+}
+
+
+/*
+ * Calculate the extends reached while printing gcode data.
+ * When deposition=false this includes all movements.
+ * When deposition=true this includes only movements that deposit material on
+ * the print bed.
+ * When "jobs" is greater than one the file is analysed in that many parallel
+ * chunks.
+ */
+size_t get_extends(struct extends *bounds, bool deposition,
+	bool physical, bool zmode, long int zmin, struct region *ignore,
+	bool verbose, const char *filename, unsigned int jobs)
+{
+	struct gvm m;
+	struct gvm_batch b;
+	struct extends_pass p;
+	size_t lines;
+
+	if (deposition && zmode) {
+		fprintf(stderr, "deposition and zmode cannot be used\n");
+		abort();
+	}
+
+	/* Parallel chunks would interleave verbose output */
+	if (jobs > 1 && !verbose && get_extends_parallel(bounds, &lines,
+		deposition, physical, zmode, zmin, ignore, filename, jobs) == 0)
+		return lines;
+
+	extends_init(&p, deposition, zmode, zmin, ignore, verbose);
+	p.bounds = *bounds;
+
+	gvm_init(&m, verbose);
+	gvm_load(&m, filename);
+
+	/* Step one line at a time so verbose output stays interleaved */
+	gvm_batch_init(&b, verbose ? 1 : BATCH_LINES);
+
+	while (gvm_step_batch(&m, &b, physical) > 0)
+		extends_batch(&p, &b, physical);
+
+	gvm_batch_free(&b);
 	gvm_close(&m);
 
+	*bounds = p.bounds;
+
 	return gvm_get_counter(&m);
 }
@@ -1,4 +1,8 @@
+#ifndef H_STATS
+#define H_STATS
+
 #include <stdbool.h>
+#include <stdint.h>
 #include "point.h"
 
 
@@ -26,8 +30,8 @@ struct region {
 
 void bounds_clear(struct extends *value);
 
-float get_progress_table(unsigned int **table, size_t *lines,
-                                                        const char *filename);
 size_t get_extends(struct extends *bounds, bool deposition,
 	bool physical, bool zmode, long int zmin, struct region *ignore,
-	bool verbose, const char *filename);
+	bool verbose, const char *filename, unsigned int jobs);
+
+#endif
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE /* clock_gettime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../gvm.h"
+
+
+/*
+ * Return seconds elapsed since "start".
+ */
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)(now.tv_sec - start->tv_sec) +
+			(double)(now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+
+/*
+ * Run the whole of "path" through the gvm using the chosen reader "repeat"
+ * times, leaving the final state in "result".
+ */
+static void run(const char *label, const char *path, bool mapped, int repeat,
+					struct point *result, unsigned int *lines)
+{
+	struct gvm m;
+	struct point pos;
+	struct timespec start;
+	double seconds;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < repeat; i++) {
+		gvm_init(&m, false);
+		m.mapped = mapped;
+		gvm_load(&m, path);
+
+		while (gvm_step(&m) != -1)
+			gvm_get_position(&m, &pos, true);
+
+		*lines = gvm_get_counter(&m);
+		*result = m.position;
+		gvm_close(&m);
+	}
+
+	seconds = elapsed(&start);
+
+	printf("%-8s %10u lines %8.3fs %12.0f lines/s\n", label, *lines,
+			seconds, (double)*lines * repeat / seconds);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct point stream;
+	struct point mapped;
+	unsigned int stream_lines;
+	unsigned int mapped_lines;
+	int repeat = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: gvm-read FILE [REPEAT]\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 2)
+		repeat = atoi(argv[2]);
+
+	run("stdio", argv[1], false, repeat, &stream, &stream_lines);
+	run("mapped", argv[1], true, repeat, &mapped, &mapped_lines);
+
+	if (memcmp(&stream, &mapped, sizeof(struct point)) != 0) {
+		fprintf(stderr, "final positions differ\n");
+		point_print(stderr, &stream);
+		point_print(stderr, &mapped);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE /* posix_openpt, clock_gettime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+/*
+ * Return seconds elapsed since "start".
+ */
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)(now.tv_sec - start->tv_sec) +
+			(double)(now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+
+/*
+ * Read "path" into memory setting "length" to its size.
+ */
+static char *slurp(const char *path, size_t *length)
+{
+	FILE *stream;
+	char *data;
+	long size;
+
+	stream = fopen(path, "r");
+
+	if (stream == NULL || fseek(stream, 0, SEEK_END) != 0 ||
+						(size = ftell(stream)) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	rewind(stream);
+	data = malloc(size + 1);
+
+	if (data == NULL || fread(data, 1, size, stream) != (size_t)size) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(stream);
+	*length = size;
+
+	return data;
+}
+
+
+/*
+ * Start "core" on the slave side of a pty with its stdin read from "input",
+ * as a printer would see it.
+ */
+static pid_t start_core(const char *core, const char *slave, int input)
+{
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid > 0)
+		return pid;
+
+	setenv("AG_SERIALPORT", slave, 1);
+
+	dup2(input, STDIN_FILENO);
+
+	/* Acknowledgements are not of interest */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		exit(EXIT_FAILURE);
+
+	execl(core, core, (char *)NULL);
+	perror(core);
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Act as a printer that acknowledges every line on pty "master" as soon as it
+ * arrives while "repeat" copies of "gcode" are written to the core through
+ * "input". Returns the number of lines acknowledged.
+ */
+static unsigned long printer(int master, int input, const char *gcode,
+				size_t length, int repeat, double *seconds)
+{
+	struct pollfd fds[2];
+	struct timespec start;
+	char buffer[65536];
+	unsigned long lines = 0;
+	size_t written = 0;
+	int started = 0;
+	ssize_t n, i;
+
+	while (1) {
+		fds[0].fd = master;
+		fds[0].events = POLLIN;
+		fds[1].fd = input;
+		fds[1].events = POLLOUT;
+
+		if (poll(fds, input == -1 ? 1 : 2, 5000) <= 0)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			n = read(master, buffer, sizeof(buffer));
+
+			if (n <= 0)
+				break;
+
+			if (!started) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				started = 1;
+			}
+
+			for (i = 0; i < n; i++) {
+				if (buffer[i] != '\n')
+					continue;
+
+				lines++;
+
+				if (write(master, "ok\n", 3) != 3)
+					return lines;
+			}
+		} else if (fds[0].revents & (POLLERR | POLLHUP)) {
+			break;
+		}
+
+		if (input != -1 && (fds[1].revents & POLLOUT)) {
+			n = write(input, gcode + written % length,
+						length - written % length);
+
+			if (n > 0)
+				written += n;
+
+			if (written >= length * repeat) {
+				close(input);
+				input = -1;
+			}
+		}
+	}
+
+	*seconds = started ? elapsed(&start) : 0.0;
+
+	return lines;
+}
+
+
+int main(int argc, char *argv[])
+{
+	char *gcode;
+	char *slave;
+	size_t length;
+	unsigned long lines;
+	double seconds;
+	int repeat = 1;
+	int master;
+	int pipes[2];
+	pid_t pid;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: serial-pty CORE FILE [REPEAT]\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 3)
+		repeat = atoi(argv[3]);
+
+	gcode = slurp(argv[2], &length);
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1 ||
+					(slave = ptsname(master)) == NULL) {
+		perror("pty");
+		return EXIT_FAILURE;
+	}
+
+	if (pipe(pipes) == -1) {
+		perror("pipe");
+		return EXIT_FAILURE;
+	}
+
+	/* The core must see the end of its input and nothing of the pty */
+	fcntl(master, F_SETFD, FD_CLOEXEC);
+	fcntl(pipes[1], F_SETFD, FD_CLOEXEC);
+
+	pid = start_core(argv[1], slave, pipes[0]);
+	close(pipes[0]);
+	fcntl(pipes[1], F_SETFL, O_NONBLOCK);
+
+	lines = printer(master, pipes[1], gcode, length, repeat, &seconds);
+
+	waitpid(pid, NULL, 0);
+
+	printf("%-8s %10lu lines %8.3fs %12.0f lines/s\n", "pty", lines,
+			seconds, seconds > 0.0 ? (double)lines / seconds : 0.0);
+
+	free(gcode);
+	close(master);
+
+	return EXIT_SUCCESS;
+}
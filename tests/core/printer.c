@@ -0,0 +1,360 @@
+#define _GNU_SOURCE /* posix_openpt */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../journal.h"
+
+/* Milliseconds without a line before the core is taken to have hung */
+#define PRINTER_IDLE	2000
+
+/* Lines held while starting, answered this many milliseconds apart */
+#define PRINTER_QUEUE	16
+#define PRINTER_SLOW	150
+#define PRINTER_LINE	256
+
+
+/*
+ * Firmware as the core sees it. Lines that arrive while it starts are held in
+ * "queue" and answered one at a time from "due".
+ */
+struct printer {
+	int master;
+	long reject;
+	long halt;
+	long expected;
+	int stopped;
+	int lost;
+
+	long boot;
+	long started;
+	long due;
+	char queue[PRINTER_QUEUE][PRINTER_LINE];
+	int queued;
+};
+
+
+/*
+ * Return a monotonic clock in milliseconds.
+ */
+static long clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Start "core" on the slave side of a pty with its stdin read from "path".
+ */
+static pid_t start_core(const char *core, const char *slave, const char *path)
+{
+	pid_t pid = fork();
+	int input;
+
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid > 0)
+		return pid;
+
+	setenv("AG_SERIALPORT", slave, 1);
+
+	input = open(path, O_RDONLY);
+
+	if (input == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	dup2(input, STDIN_FILENO);
+
+	/* Only what reaches the printer is of interest */
+	if (freopen("/dev/null", "w", stdout) == NULL ||
+				freopen("/dev/null", "w", stderr) == NULL)
+		exit(EXIT_FAILURE);
+
+	execl(core, core, (char *)NULL);
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Return the number of "line", or -1 if it is not numbered, and set "command"
+ * to the gcode after the number.
+ */
+static long line_number(const char *line, const char **command)
+{
+	char *end;
+	long number;
+
+	*command = line;
+
+	if (line[0] != 'N')
+		return -1;
+
+	number = strtol(line + 1, &end, 10);
+
+	while (*end == ' ')
+		end++;
+
+	*command = end;
+
+	return number;
+}
+
+
+/*
+ * Reply to "line" as firmware would. A numbered line other than the one
+ * expected is rejected with a resend request, and so is the first copy of
+ * line "reject". Nothing is acknowledged once M112 has stopped the printer,
+ * and the power is lost as line "halt" is accepted.
+ */
+static void reply(struct printer *p, const char *line)
+{
+	const char *command;
+	char message[64];
+	long number;
+	int length;
+
+	number = line_number(line, &command);
+
+	if (p->stopped)
+		return;
+
+	if (number >= 0 && (number != p->expected || number == p->reject)) {
+		length = sprintf(message, "Resend: %ld\nok\n", p->expected);
+
+		if (write(p->master, message, length) != length)
+			exit(EXIT_FAILURE);
+
+		/* Only the first copy is rejected */
+		if (number == p->reject)
+			p->reject = -1;
+
+		return;
+	}
+
+	/* The line is accepted but never acknowledged */
+	if (number >= 0 && number == p->halt) {
+		p->lost = 1;
+		return;
+	}
+
+	if (number >= 0)
+		p->expected++;
+
+	if (strncmp(command, "M112", 4) == 0 && !isdigit(command[4])) {
+		p->stopped = 1;
+		return;
+	}
+
+	if (write(p->master, "ok\n", 3) != 3)
+		exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Take "line" as it arrives, holding it while the printer starts or lines
+ * that arrived before it are still to be answered.
+ */
+static void receive(struct printer *p, const char *line)
+{
+	size_t length;
+
+	if (p->boot < 0) {
+		reply(p, line);
+		return;
+	}
+
+	if (p->started < 0) {
+		p->started = clock_ms();
+		p->due = p->started + p->boot;
+	}
+
+	if (p->queued == 0 && clock_ms() >= p->started + p->boot) {
+		reply(p, line);
+		return;
+	}
+
+	if (p->queued == PRINTER_QUEUE) {
+		fprintf(stderr, "printer: queue full\n");
+		exit(EXIT_FAILURE);
+	}
+
+	length = strlen(line);
+
+	if (length >= PRINTER_LINE)
+		length = PRINTER_LINE - 1;
+
+	memcpy(p->queue[p->queued], line, length);
+	p->queue[p->queued][length] = '\0';
+	p->queued++;
+}
+
+
+/*
+ * Answer the held lines that are due, slowly as a printer still starting.
+ */
+static void answer(struct printer *p)
+{
+	while (p->queued > 0 && !p->lost && clock_ms() >= p->due) {
+		reply(p, p->queue[0]);
+
+		memmove(p->queue[0], p->queue[1], (p->queued - 1) *
+							sizeof(p->queue[0]));
+		p->queued--;
+		p->due += PRINTER_SLOW;
+	}
+}
+
+
+/*
+ * Run the core on a pty as a printer would see it, with its input read from a
+ * file, and print every line it writes. With -r the first copy of numbered
+ * line LINE is rejected, with -h the power is lost as numbered line LINE is
+ * accepted, with -b the lines that arrive in the first MS milliseconds are
+ * answered PRINTER_SLOW milliseconds apart from then, and with -j the core
+ * keeps journal JOURNAL and the line recorded in it is printed once the core
+ * has exited.
+ */
+int main(int argc, char *argv[])
+{
+	struct printer p;
+	struct pollfd fds;
+	char buffer[4096];
+	char line[4096];
+	size_t length = 0;
+	const char *journal = NULL;
+	uint64_t journaled, offset;
+	int status;
+	int timeout;
+	char *slave;
+	pid_t pid;
+	ssize_t n, i;
+	int opt;
+
+	memset(&p, 0, sizeof(struct printer));
+	p.reject = -1;
+	p.halt = -1;
+	p.boot = -1;
+	p.started = -1;
+
+	while ((opt = getopt(argc, argv, "r:h:b:j:")) != -1) {
+		switch (opt) {
+			case 'r':
+				p.reject = atol(optarg);
+				break;
+			case 'h':
+				p.halt = atol(optarg);
+				break;
+			case 'b':
+				p.boot = atol(optarg);
+				break;
+			case 'j':
+				journal = optarg;
+				setenv("AG_JOURNAL", journal, 1);
+				break;
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, "Usage: printer [-r LINE] [-h LINE] [-b MS] "
+					"[-j JOURNAL] CORE INPUT\n");
+		return EXIT_FAILURE;
+	}
+
+	p.master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (p.master == -1 || grantpt(p.master) == -1 ||
+				unlockpt(p.master) == -1 ||
+				(slave = ptsname(p.master)) == NULL) {
+		perror("pty");
+		return EXIT_FAILURE;
+	}
+
+	fcntl(p.master, F_SETFD, FD_CLOEXEC);
+
+	pid = start_core(argv[optind], slave, argv[optind + 1]);
+
+	/* Print each line written to the printer until the core closes it */
+	while (!p.lost) {
+		fds.fd = p.master;
+		fds.events = POLLIN;
+
+		timeout = PRINTER_IDLE;
+
+		if (p.queued > 0 && p.due - clock_ms() < timeout)
+			timeout = p.due > clock_ms() ? p.due - clock_ms() : 0;
+
+		n = poll(&fds, 1, timeout);
+
+		if (n == 0 && p.queued > 0) {
+			answer(&p);
+			continue;
+		}
+
+		if (n <= 0) {
+			fprintf(stderr, "printer: core hung\n");
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			return EXIT_FAILURE;
+		}
+
+		n = read(p.master, buffer, sizeof(buffer));
+
+		if (n <= 0)
+			break;
+
+		for (i = 0; i < n && !p.lost; i++) {
+			if (buffer[i] != '\n') {
+				if (length < sizeof(line) - 1)
+					line[length++] = buffer[i];
+
+				continue;
+			}
+
+			line[length] = '\0';
+			length = 0;
+
+			printf("%s\n", line);
+			receive(&p, line);
+		}
+
+		answer(&p);
+	}
+
+	/* The core fails on losing the printer, which is expected here */
+	if (p.lost)
+		close(p.master);
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return EXIT_FAILURE;
+
+	/* The last line the core recorded as acknowledged */
+	if (journal) {
+		if (journal_read(journal, &journaled, &offset))
+			printf("journal: %lu %lu\n", (unsigned long)journaled,
+							(unsigned long)offset);
+		else
+			printf("journal: none\n");
+	}
+
+	return p.lost ? EXIT_SUCCESS : WEXITSTATUS(status);
+}
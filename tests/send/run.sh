@@ -0,0 +1,120 @@
+#!/bin/bash
+
+PATH="`git rev-parse --show-toplevel`:${PATH}"
+
+OUTPUT=`mktemp`
+VERBOSE=false
+FAIL=false
+ERRORS=/dev/null
+
+declare -i FAILURES=0
+
+trap 'rm -f "${OUTPUT}"' EXIT
+
+# Progress must come from analysis of the test file
+export AG_CACHE=""
+
+
+usage()
+{
+    echo "Usage: $1 [OPTIONS] [TEST..]" >&2
+    echo >&2
+    echo "Options:" >&2
+    echo "  -v  explain what is being done" >&2
+    echo "  -h  display this help and exit" >&2
+}
+
+
+while getopts 'hv' OPTION
+do
+    case "${OPTION}" in
+
+        h)
+            usage `basename "${0}"`
+            exit 0
+            ;;
+        v)
+            VERBOSE=true
+            ERRORS=/dev/stderr
+            ;;
+    esac
+done
+
+shift $((${OPTIND} - 1))
+
+for TEST in $@; do
+    FAIL=false
+    OPTS="`cat "$TEST/flags"`"
+    GCODE="${TEST}/gcode"
+
+    if $VERBOSE
+    then
+        echo " START: ${TEST}" >&2
+        echo "   RUN: austerus-send -p NULL -s -v ${OPTS} ${GCODE}" >&2
+
+        if [ -e "${TEST}/pipe" ]
+        then
+            echo "  FROM: standard input" >&2
+        fi
+    fi
+
+    # Only the lines matched are certain to arrive in the same order
+    if [ -e "${TEST}/pipe" ]
+    then
+        cat "${GCODE}" | \
+            austerus-send -p NULL -s -v $OPTS - 2> "${ERRORS}" | \
+            grep -E -f "${TEST}/match" > "${OUTPUT}"
+        RC=${PIPESTATUS[1]}
+    else
+        austerus-send -p NULL -s -v $OPTS "${GCODE}" \
+            2> "${ERRORS}" | grep -E -f "${TEST}/match" > "${OUTPUT}"
+        RC=${PIPESTATUS[0]}
+    fi
+
+    if [ "${RC}" -ne 0 ]
+    then
+        if ${VERBOSE}
+        then
+            echo "bad exit code ${RC}" >&2
+        fi
+
+        FAIL=true
+    fi
+
+    if ${VERBOSE}
+    then
+        diff -u $TEST/output $OUTPUT >&2
+    else
+        diff -u $TEST/output $OUTPUT > /dev/null
+    fi
+
+    RC=$?
+
+    if [ "${RC}" -ne 0 ]
+    then
+        FAIL=true
+    fi
+
+    if ${FAIL}
+    then
+        FAILURES+=1
+        echo "FAILED: ${TEST}" >&2
+    else
+        if ${VERBOSE}
+        then
+            echo "PASSED: ${TEST}" >&2
+        fi
+    fi
+done
+
+if [ "${FAILURES}" -gt 0 ]
+then
+    if ${VERBOSE}
+    then
+        echo "${FAILURES} failures" >&2
+    else
+        echo "run in verbose mode for more details:" >&2
+        echo "$0 -v $@" >&2
+    fi
+    exit 1
+fi
@@ -3,23 +3,32 @@
 PATH="`git rev-parse --show-toplevel`:${PATH}"
 
 OUTPUT=`mktemp`
+COMPILED=`mktemp`
 VERBOSE=false
+COMPILE=false
+CACHE=false
+JOBS=""
 FAIL=false
 
 declare -i FAILURES=0
 
+trap 'rm -rf "${OUTPUT}" "${COMPILED}" ${AG_CACHE:+"${AG_CACHE}"}' EXIT
+
 
 usage()
 {
     echo "Usage: $1 [OPTIONS] [TEST..]" >&2
     echo >&2
     echo "Options:" >&2
+    echo "  -c  analyse compiled gcode" >&2
+    echo "  -C  analyse twice through an empty cache" >&2
+    echo "  -j  analyse in JOBS parallel chunks" >&2
     echo "  -v  explain what is being done" >&2
     echo "  -h  display this help and exit" >&2
 }
 
 
-while getopts 'hv' OPTION
+while getopts 'cChj:v' OPTION
 do
     case "${OPTION}" in
 
@@ -27,6 +36,15 @@ do
             usage `basename "${0}"`
             exit 0
             ;;
+        c)
+            COMPILE=true
+            ;;
+        C)
+            CACHE=true
+            ;;
+        j)
+            JOBS="--jobs=${OPTARG}"
+            ;;
         v)
             VERBOSE=true
             ;;
@@ -35,42 +53,63 @@ done
 
 shift $((${OPTIND} - 1))
 
+# Results must come from analysis unless the cache is under test
+if ${CACHE}
+then
+    export AG_CACHE=`mktemp -d`
+    RUNS=2
+else
+    export AG_CACHE=""
+    RUNS=1
+fi
+
 for TEST in $@; do
     FAIL=false
-    OPTS=`cat "$TEST/flags"`
+    OPTS="`cat "$TEST/flags"` ${JOBS}"
+    GCODE="${TEST}/gcode"
+
+    if ${COMPILE}
+    then
+        austerus-compile "${GCODE}" "${COMPILED}" || FAIL=true
+        GCODE="${COMPILED}"
+    fi
 
     if $VERBOSE
     then
         echo " START: ${TEST}" >&2
-        echo "   RUN: austerus-verge ${OPTS} ${TEST}/gcode" >&2
+        echo "   RUN: austerus-verge ${OPTS} ${GCODE}" >&2
     fi
 
-    austerus-verge $OPTS "$TEST/gcode" > "${OUTPUT}"
-    RC=$?
+    # With a cache the first run fills it and the second is served from it
+    for RUN in `seq ${RUNS}`
+    do
+        austerus-verge $OPTS "${GCODE}" > "${OUTPUT}"
+        RC=$?
 
-    if [ "${RC}" -ne 0 ]
-    then
-        if ${VERBOSE}
+        if [ "${RC}" -ne 0 ]
         then
-            echo "bad exit code ${RC}" >&2
-        fi
+            if ${VERBOSE}
+            then
+                echo "bad exit code ${RC}" >&2
+            fi
 
-        FAIL=true
-    fi
+            FAIL=true
+        fi
 
-    if ${VERBOSE}
-    then
-        diff -u $TEST/output $OUTPUT >&2
-    else
-        diff -u $TEST/output $OUTPUT > /dev/null
-    fi
+        if ${VERBOSE}
+        then
+            diff -u $TEST/output $OUTPUT >&2
+        else
+            diff -u $TEST/output $OUTPUT > /dev/null
+        fi
 
-    RC=$?
+        RC=$?
 
-    if [ "${RC}" -ne 0 ]
-    then
-        FAIL=true
-    fi
+        if [ "${RC}" -ne 0 ]
+        then
+            FAIL=true
+        fi
+    done
 
     if ${FAIL}
     then
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE /* clock_gettime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+
+/*
+ * Return monotonic time in microseconds.
+ */
+int64_t trace_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Start recording a trace to "path". Tracing is disabled if it cannot be
+ * written. Returns false on error.
+ */
+bool trace_open(struct trace *t, const char *path)
+{
+	struct trace_header header;
+
+	memset(t, 0, sizeof(struct trace));
+
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (t->fd == -1)
+		return false;
+
+	memset(&header, 0, sizeof(struct trace_header));
+	memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	header.version = TRACE_VERSION;
+	header.size = sizeof(struct trace_record);
+
+	if (write(t->fd, &header, sizeof(struct trace_header)) !=
+					sizeof(struct trace_header)) {
+		close(t->fd);
+		t->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Add a record to those waiting to be written, writing them first if there
+ * is no space.
+ */
+static void trace_record(struct trace *t, const struct trace_record *r)
+{
+	if (t->recorded == TRACE_RECORDS)
+		trace_flush(t, true);
+
+	if (t->fd == -1)
+		return;
+
+	t->records[t->recorded++] = *r;
+}
+
+
+/*
+ * Add a line of "length" bytes queued for the port to those in flight. It was
+ * read from the input at time "read", or 0 if it was not.
+ */
+void trace_queued(struct trace *t, size_t length, int64_t read,
+							unsigned int flags)
+{
+	struct trace_record *r;
+	unsigned int slot;
+
+	if (t->fd == -1 || t->count == TRACE_LINES)
+		return;
+
+	slot = (t->first + t->count) % TRACE_LINES;
+	r = &(t->lines[slot]);
+
+	r->read = read;
+	r->written = 0;
+	r->acked = 0;
+	r->number = t->number++;
+	r->length = length;
+	r->flags = flags;
+
+	t->queued += length;
+	t->ends[slot] = t->queued;
+	t->count++;
+}
+
+
+/*
+ * Note "length" more bytes written to the port and the time the lines they
+ * complete were written.
+ */
+void trace_written(struct trace *t, size_t length)
+{
+	int64_t now;
+	unsigned int slot;
+
+	if (t->fd == -1)
+		return;
+
+	t->sent += length;
+	now = trace_clock();
+
+	while (t->unsent < t->count) {
+		slot = (t->first + t->unsent) % TRACE_LINES;
+
+		if (t->ends[slot] > t->sent)
+			break;
+
+		t->lines[slot].written = now;
+		t->unsent++;
+	}
+}
+
+
+/*
+ * Record the oldest line in flight as acknowledged.
+ */
+void trace_acked(struct trace *t)
+{
+	struct trace_record *r;
+
+	if (t->fd == -1 || t->count == 0)
+		return;
+
+	r = &(t->lines[t->first]);
+	r->acked = trace_clock();
+	trace_record(t, r);
+
+	t->first = (t->first + 1) % TRACE_LINES;
+	t->count--;
+
+	if (t->unsent > 0)
+		t->unsent--;
+}
+
+
+/*
+ * Record every line in flight as lost.
+ */
+void trace_clear(struct trace *t)
+{
+	struct trace_record *r;
+
+	if (t->fd == -1)
+		return;
+
+	while (t->count > 0) {
+		r = &(t->lines[t->first]);
+		r->flags |= TRACE_LOST;
+		trace_record(t, r);
+
+		t->first = (t->first + 1) % TRACE_LINES;
+		t->count--;
+	}
+
+	t->unsent = 0;
+}
+
+
+/*
+ * Write the records waiting once there are enough to be worth a write, or
+ * any there are if "force" is set. Tracing is disabled on error.
+ */
+void trace_flush(struct trace *t, bool force)
+{
+	size_t size = t->recorded * sizeof(struct trace_record);
+
+	if (t->fd == -1 || t->recorded == 0)
+		return;
+
+	if (!force && t->recorded < TRACE_FLUSH)
+		return;
+
+	if (write(t->fd, t->records, size) != (ssize_t)size) {
+		perror("Warning: trace write failed");
+		close(t->fd);
+		t->fd = -1;
+	}
+
+	t->recorded = 0;
+}
+
+
+/*
+ * Write the records waiting and stop recording.
+ */
+void trace_close(struct trace *t)
+{
+	trace_flush(t, true);
+
+	if (t->fd != -1)
+		close(t->fd);
+
+	t->fd = -1;
+}
+
+
+/*
+ * Read the trace at "path" and set "count" to the number of records in it.
+ * Returns the records, to be freed by the caller, or NULL if the file is not
+ * a trace of this version.
+ */
+struct trace_record *trace_load(const char *path, size_t *count)
+{
+	struct trace_header header;
+	struct trace_record *records;
+	struct stat st;
+	FILE *stream;
+
+	stream = fopen(path, "r");
+
+	if (stream == NULL)
+		return NULL;
+
+	if (fstat(fileno(stream), &st) == -1 ||
+		fread(&header, sizeof(struct trace_header), 1, stream) != 1 ||
+		memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0 ||
+		header.version != TRACE_VERSION ||
+		header.size != sizeof(struct trace_record)) {
+		fclose(stream);
+		return NULL;
+	}
+
+	*count = (st.st_size - sizeof(struct trace_header)) /
+						sizeof(struct trace_record);
+
+	records = malloc(*count * sizeof(struct trace_record) + 1);
+
+	if (records == NULL ||
+		fread(records, sizeof(struct trace_record), *count, stream) !=
+								*count) {
+		free(records);
+		fclose(stream);
+		return NULL;
+	}
+
+	fclose(stream);
+
+	return records;
+}
@@ -0,0 +1,87 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC		"AGTR"
+#define TRACE_MAGIC_LEN		4
+#define TRACE_VERSION		1
+
+/* Lines in flight, at least WINDOW_LINES */
+#define TRACE_LINES		256
+/* Completed records held before writing, and when to write them */
+#define TRACE_RECORDS		4096
+#define TRACE_FLUSH		(TRACE_RECORDS / 2)
+
+/* Record flags */
+#define TRACE_QUIET		1
+#define TRACE_LOST		2
+
+
+/*
+ * A trace starts with this header followed by records until the end of the
+ * file, both in native byte order.
+ */
+struct trace_header {
+	char magic[TRACE_MAGIC_LEN];
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+
+/*
+ * One line written to the printer, numbered in the order written, with the
+ * times in microseconds it was read from the input, fully written to the
+ * serial port and acknowledged. Lines resent or written before the input is
+ * read have a read time of 0, and lines given up on after a serial timeout are
+ * flagged lost with an acknowledged time of 0.
+ */
+struct trace_record {
+	int64_t read;
+	int64_t written;
+	int64_t acked;
+	uint32_t number;
+	uint16_t length;
+	uint16_t flags;
+};
+
+
+/*
+ * Trace being recorded. Lines in flight are held oldest first with the total
+ * bytes queued for the port once each was added, so they are known to be
+ * written once that many bytes have left. Acknowledged lines are held in
+ * "records" until written to "fd".
+ */
+struct trace {
+	int fd;
+	uint32_t number;
+	uint64_t queued;
+	uint64_t sent;
+
+	struct trace_record lines[TRACE_LINES];
+	uint64_t ends[TRACE_LINES];
+	unsigned int first;
+	unsigned int count;
+	unsigned int unsent;
+
+	struct trace_record records[TRACE_RECORDS];
+	unsigned int recorded;
+};
+
+
+int64_t trace_clock(void);
+
+bool trace_open(struct trace *t, const char *path);
+void trace_queued(struct trace *t, size_t length, int64_t read,
+							unsigned int flags);
+void trace_written(struct trace *t, size_t length);
+void trace_acked(struct trace *t);
+void trace_clear(struct trace *t);
+void trace_flush(struct trace *t, bool force);
+void trace_close(struct trace *t);
+
+struct trace_record *trace_load(const char *path, size_t *count);
+
+#endif